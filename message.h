@@ -1,5 +1,6 @@
 #ifndef __message_h__
 #define __message_h__
+#include <string.h>
 #include "mfs.h"
 
 # define DIR_ENTRIES_IN_BLOCK (64) // MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t)
@@ -18,7 +19,12 @@ enum MFS_OPS {
   MFS_CREAT,
   MFS_UNLINK,
   MFS_SHUTDOWN,
-  MFS_FEEDBACK
+  MFS_FEEDBACK,
+  MFS_READ_RANGE,
+  MFS_WRITE_RANGE,
+  MFS_LOOKUP_PATH,
+  MFS_COMPOUND,
+  MFS_READDIR
 };
 
 typedef struct Block_t {
@@ -43,4 +49,177 @@ typedef struct message_t {
         MFS_Stat_t st;   // Stat struct 
 } message_t;
 
+// Compact wire format: a wire_hdr_t followed by only the payload bytes in
+// use (the name of LOOKUP/CREAT/UNLINK requests, the data of WRITE requests
+// and READ replies). message_t stays the in-memory form on both ends; a
+// datagram of exactly sizeof(message_t) is a legacy message_t.
+#define MFS_WIRE_VERSION (2)
+#define WIRE_REPLY (0x1)
+#define WIRE_INVAL (0x2)        // the payload lists inodes changed since the client's epoch
+#define WIRE_FLUSH (0x4)        // too much changed since the client's epoch: drop all cached
+
+typedef struct wire_hdr_t {
+        unsigned char version;  // MFS_WIRE_VERSION
+        unsigned char op;       // enum MFS_OPS
+        unsigned char flags;    // WIRE_REPLY
+        unsigned char pad;
+        unsigned int reqid;     // chosen by the client, echoed in the reply
+        int inum;               // node_num: inode number, or the result in replies
+        int offset;
+        int nbytes;
+        int arg;                // mtype in requests, st.type in replies
+        int size;               // st.size in replies
+        unsigned int len;       // payload bytes after the header
+        unsigned int epoch;     // invalidations applied (requests) or reported (lookup/stat replies)
+        int lease;              // lookup/stat replies: ms the answer may be cached
+} wire_hdr_t;
+
+#define WIRE_MAX (sizeof(wire_hdr_t) + MFS_BLOCK_SIZE)
+
+// Ranged reads and writes move up to WIRE_WINDOW blocks per request, one
+// block per datagram. Each fragment carries its own file offset and nbytes.
+// MFS_WRITE_RANGE fragments also name their range (start in st.size,
+// length in mtype); MFS_READ_RANGE reply fragments carry the range length
+// in st.size.
+#define WIRE_WINDOW (32)
+#define WIRE_RANGE_MAX (WIRE_WINDOW * MFS_BLOCK_SIZE)
+
+// Over TCP (an MFS_Init host named "tcp://host", a server started with -T)
+// the same datagrams are sent as frames on one connection, each preceded by
+// its length as a 4-byte big-endian count, and answered in order. A read,
+// ranged or not, is answered with a single frame holding all of its data.
+#define WIRE_TCP "tcp://"
+
+// Lookup and stat replies piggyback up to WIRE_INVAL_MAX inode numbers
+// (ints) changed since the epoch in the request, then carry the new epoch.
+#define WIRE_INVAL_MAX (64)
+
+// MFS_LOOKUP_PATH resolves a slash-separated path (the request payload,
+// nbytes long with its NUL) from inode node_num, or from the root if it
+// starts with '/'. The reply carries the final inode in node_num and a
+// wire_comp_t per component, nbytes in all, then its invalidations.
+#define WIRE_PATH_MAX (256)     // components
+typedef struct wire_comp_t {
+        int inum;
+        int type;
+        int size;
+} wire_comp_t;
+
+// MFS_COMPOUND carries up to WIRE_OPS_MAX sub-operations (lookup, stat,
+// read, write, creat, unlink), each a wire_op_t followed by its name or
+// write data, nbytes in all. They run in order until one fails. The reply
+// holds a wire_res_t per operation run, each followed by its read data,
+// nbytes in all, and node_num is 0 if every operation succeeded.
+#define WIRE_OPS_MAX (64)
+typedef struct wire_op_t {
+        int op;                 // enum MFS_OPS
+        int ref;                // earlier operation whose inode replaces inum, -1 for none
+        int inum;
+        int offset;
+        int nbytes;
+        int arg;                // mtype of creat
+        unsigned int len;       // bytes following
+} wire_op_t;
+typedef struct wire_res_t {
+        int rc;                 // node_num of the single operation's reply
+        int inum;               // inode looked up, created or acted on
+        int type;               // stat
+        int size;
+        unsigned int len;       // read data following
+} wire_res_t;
+
+// MFS_READDIR lists directory node_num from a cookie: the slot offset of a
+// linear directory, the name (payload) after which a B-tree one resumes.
+// nbytes bounds the reply, which comes back like a range read: fragments of
+// a wire_dirent_t array, st.size bytes long, and the next slot offset in
+// st.type, -1 once the directory is exhausted. A nonzero mtype asks for each
+// entry's type and size too. The array is preceded by the invalidations
+// piggybacked on the listing: a wire_inval_t, then n inode numbers (ints).
+typedef struct wire_dirent_t {
+        char name[28];
+        int inum;
+        int type;               // -1 if not asked for, or gone meanwhile
+        int size;
+} wire_dirent_t;
+typedef struct wire_inval_t {
+        unsigned int epoch;     // as in lookup and stat replies
+        int n;                  // -1: drop everything cached
+} wire_inval_t;
+#define WIRE_DIRINVAL_MAX (sizeof(wire_inval_t) + WIRE_INVAL_MAX * sizeof(int))
+
+static inline int wire_names(int op) {
+        return op == MFS_LOOKUP || op == MFS_CREAT || op == MFS_UNLINK || op == MFS_READDIR;
+}
+
+/* wire_header: fill in the header for m, without payload (len 0); data
+sent from elsewhere follows it with its length set in h->len */
+static inline void wire_header(message_t *m, int op, unsigned int reqid, int flags, wire_hdr_t *h) {
+        memset(h, 0, sizeof(wire_hdr_t));
+        h->version = MFS_WIRE_VERSION;
+        h->op = op;
+        h->flags = flags;
+        h->reqid = reqid;
+        h->inum = m->node_num;
+        h->offset = m->offset;
+        h->nbytes = m->nbytes;
+        h->arg = (flags & WIRE_REPLY) ? m->st.type : m->mtype;
+        h->size = m->st.size;
+}
+
+/* wire_encode: pack m as a request (flags 0) or reply (WIRE_REPLY) for op
+returns: datagram length */
+static inline int wire_encode(message_t *m, int op, unsigned int reqid, int flags, char *out) {
+        wire_hdr_t *h = (wire_hdr_t *) out;
+        char *payload = out + sizeof(wire_hdr_t);
+        wire_header(m, op, reqid, flags, h);
+        if (!(flags & WIRE_REPLY) && wire_names(op)) {
+                h->len = strnlen(m->name, sizeof(m->name) - 1) + 1;
+                memcpy(payload, m->name, h->len - 1);
+                payload[h->len - 1] = '\0';
+        } else if ((!(flags & WIRE_REPLY) && (op == MFS_WRITE || op == MFS_WRITE_RANGE))
+                || ((flags & WIRE_REPLY) && (op == MFS_READ || op == MFS_READ_RANGE
+                        || op == MFS_READDIR) && m->node_num == 0) || op == MFS_LOOKUP_PATH || op == MFS_COMPOUND) {
+                h->len = m->nbytes < 0 ? 0 : m->nbytes > MFS_BLOCK_SIZE ? MFS_BLOCK_SIZE : m->nbytes;
+                memcpy(payload, m->buf, h->len);
+        }
+        return sizeof(wire_hdr_t) + h->len;
+}
+
+/* wire_fields: copy the fields of header h into m, leaving the payload */
+static inline void wire_fields(wire_hdr_t *h, message_t *m) {
+        m->msg = h->op;
+        m->node_num = h->inum;
+        m->offset = h->offset;
+        m->nbytes = h->nbytes;
+        m->mtype = h->arg;
+        m->st.type = h->arg;
+        m->st.size = h->size;
+}
+
+/* wire_decode: unpack a datagram of len bytes into m
+returns: 0 for the compact format, 1 for a legacy message_t, -1 if malformed */
+static inline int wire_decode(char *in, int len, message_t *m, unsigned int *reqid, int *flags) {
+        if (len == sizeof(message_t)) {
+                memcpy(m, in, sizeof(message_t));
+                *reqid = 0;
+                *flags = 0;
+                return 1;
+        }
+        wire_hdr_t *h = (wire_hdr_t *) in;
+        if (len < (int) sizeof(wire_hdr_t) || h->version != MFS_WIRE_VERSION
+                || h->len > MFS_BLOCK_SIZE || sizeof(wire_hdr_t) + h->len > len)
+                return -1;
+        *reqid = h->reqid;
+        *flags = h->flags;
+        wire_fields(h, m);
+        if (!(h->flags & WIRE_REPLY) && wire_names(h->op)) {
+                if (h->len == 0 || h->len > sizeof(m->name)) return -1;
+                memcpy(m->name, in + sizeof(wire_hdr_t), h->len);
+                m->name[h->len - 1] = '\0';
+        } else {
+                memcpy(m->buf, in + sizeof(wire_hdr_t), h->len);
+        }
+        return 0;
+}
+
 #endif // __message_h__
@@ -3,7 +3,13 @@
 #include <sys/stat.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -12,76 +18,729 @@
 #include "message.h"
 #include "debug.h"
 
-/* Server_To_Client: Send file operation message to server and receive feedback.
+// important global variables
+char* my_serv = NULL; // server being used
+int working = 0; // make sure the server is currently working
+int prt = 10000; // base port
+int my_sd = -1; // socket used for every request, opened by MFS_Init
+int my_tcp = 0; // my_sd is a TCP connection (see MFS_Init)
+struct sockaddr_in my_addr; // the server's address
+unsigned int next_reqid = 0; // id of the last request sent
+
+// retransmission timer, microseconds (smoothed RTT and its variation, as in TCP)
+#define RTO_INIT (200000)
+#define RTO_MIN (20000)
+#define RTO_MAX (3000000)
+#define MAX_RETRIES (8)
+#define TCP_WAIT (RTO_MAX * MAX_RETRIES) // a request over TCP unanswered this long is given up
+long srtt = 0;
+long rttvar = 0;
+long rto = RTO_INIT;
+
+// asynchronous requests in flight (see MFS_Poll)
+#define MAX_INFLIGHT (128)
+typedef struct inflight_t {
+	int used;
+	unsigned int reqid;
+	int op;
+	char out[WIRE_MAX]; // the encoded request (a write's header only), kept for resends
+	int len;
+	long sent; // time of the last send
+	int tries; // resends so far
+	MFS_Stat_t *st; // where MFS_Stat_Async puts its answer
+	char *buf; // where MFS_Read_Async puts its data, or the caller's data MFS_Write_Async sends
+	int nbytes;
+	MFS_Done_t done;
+	void *arg;
+} inflight_t;
+inflight_t *inflight = NULL;
+int ninflight = 0;
+unsigned long ncompleted = 0;
+
+void Async_Reply(unsigned int reqid, char *in, message_t *receive, int direct);
+void Complete(int i, int result);
+
+// where the reply data of the synchronous request being waited for goes,
+// received there directly (see Reply_Dest)
+unsigned int want_reqid = 0;
+char *want_data = NULL;
+int want_start = 0;
+int want_len = 0;
+
+// lookup and attribute caches, filled from lookup and stat replies and kept
+// for the lease the server grants with them
+#define LCACHE (1024)
+#define ACACHE (1024)
+typedef struct lentry_t {
+	int valid;
+	int pinum;
+	char name[28];
+	int inum; // answer, -1 included
+	long expires; // end of the lease
+} lentry_t;
+typedef struct aentry_t {
+	int valid;
+	int inum;
+	MFS_Stat_t st;
+	long expires;
+} aentry_t;
+lentry_t lcache[LCACHE];
+aentry_t acache[ACACHE];
+unsigned int seen_epoch = 0; // last server invalidation applied
+
+// page cache: file blocks kept after reads, at most PAGE_BUDGET bytes of
+// them, each for the lease granted with its read reply
+#define PAGE_BUDGET (1 << 20)
+#define NPAGES (PAGE_BUDGET / MFS_BLOCK_SIZE)
+#define READ_AHEAD (8) // blocks prefetched ahead of a sequential reader
+#define NSTREAMS (16)
+enum { PAGE_FREE, PAGE_LOADING, PAGE_STALE, PAGE_VALID };
+typedef struct page_t {
+	int state; // PAGE_STALE: still loading, but forgotten already
+	int inum;
+	int blk; // block number within the file
+	int id; // async read filling it
+	long expires;
+	unsigned long used; // for LRU replacement
+	char data[MFS_BLOCK_SIZE];
+} page_t;
+page_t *pages = NULL;
+unsigned long page_clock = 0;
+typedef struct stream_t {
+	int inum;
+	int next; // offset a sequential reader asks for next
+	int run; // sequential reads in a row
+} stream_t;
+stream_t streams[NSTREAMS];
+int read_lease = 0; // ms, from the last read reply
+int list_lease = 0; // ms, from the last directory listing
+
+void Page_Forget(int inum);
+
+// write-back buffers (MFS_WriteBack): writes to a file held and merged into
+// extents, sent once WB_BYTES are held or the oldest is WB_MS old
+#define WB_FILES (16)
+#define WB_EXTENTS (8)
+#define WB_BYTES (16 * MFS_BLOCK_SIZE)
+#define WB_MS (200)
+typedef struct extent_t {
+	int offset;
+	int len;
+	char *data;
+} extent_t;
+typedef struct wbuf_t {
+	int used;
+	int inum;
+	long since; // time of the oldest write held
+	int bytes;
+	int n;
+	extent_t ext[WB_EXTENTS]; // disjoint, none adjacent to another
+} wbuf_t;
+wbuf_t wbufs[WB_FILES];
+int write_back = 0;
+int wb_error = 0; // a held write failed since the last MFS_Fsync
 
-Use message_t struct for messages. 
+void Wb_Flush(int inum);
+void Wb_Tick();
+
+/* now_us: monotonic clock in microseconds */
+long now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* rtt_sample: fold one round trip time into srtt/rttvar and derive the timeout */
+void rtt_sample(long r)
+{
+	if(srtt == 0){
+		srtt = r;
+		rttvar = r / 2;
+	}else{
+		long err = r - srtt;
+		srtt += err / 8;
+		rttvar += ((err < 0 ? -err : err) - rttvar) / 4;
+	}
+	rto = srtt + 4 * rttvar;
+	if(rto < RTO_MIN) rto = RTO_MIN;
+	if(rto > RTO_MAX) rto = RTO_MAX;
+}
+
+/* name_slot: lookup cache slot of a name in directory pinum */
+lentry_t *name_slot(int pinum, char *name)
+{
+	unsigned int h = (unsigned int) pinum * 2654435761u;
+	for(int i = 0; i < 28 && name[i] != '\0'; i++)
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+	return &lcache[h % LCACHE];
+}
+
+/* Cache_Find: unexpired cache entry for a name in directory pinum, NULL if none */
+lentry_t *Cache_Find(int pinum, char *name)
+{
+	lentry_t *e = name_slot(pinum, name);
+	if(e->valid && e->pinum == pinum && strncmp(e->name, name, 28) == 0 && now_us() < e->expires)
+		return e;
+	return NULL;
+}
+
+/* Cache_Forget: drop what is cached about inum, both as a file and as a directory */
+void Cache_Forget(int inum)
+{
+	aentry_t *a = &acache[(unsigned int) inum % ACACHE];
+	if(a->inum == inum)
+		a->valid = 0;
+	Page_Forget(inum);
+	for(int i = 0; i < LCACHE; i++)
+		if(lcache[i].valid && (lcache[i].pinum == inum || lcache[i].inum == inum))
+			lcache[i].valid = 0;
+}
+
+/* Forget_Name: drop what is cached about a name about to be unlinked from pinum */
+void Forget_Name(int pinum, char *name)
+{
+	lentry_t *e = Cache_Find(pinum, name);
+	if(e != NULL && e->inum >= 0)
+		Cache_Forget(e->inum);
+	Cache_Forget(pinum);
+}
+
+/* Next_Name: copy the path component at *p into name and step past it
+returns: 1, 0 at the end of the path, -1 if the component is too long
 */
-int Server_To_Client(message_t *send, message_t *receive, char *server, int pnum)
+int Next_Name(char **p, char *name)
 {
-	int sd = UDP_Open(0);
-	if(sd < -1){
-		// open failure
-		perror("udp_send: failed to open socket.");
+	while(**p == '/')
+		(*p)++;
+	int n = strcspn(*p, "/");
+	if(n == 0)
+		return 0;
+	if(n > 27)
 		return -1;
+	memcpy(name, *p, n);
+	name[n] = '\0';
+	*p += n;
+	return 1;
+}
+
+/* Cache_Inval: apply n piggybacked invalidations from list (n -1 to drop
+everything cached), reported up to the server's epoch */
+void Cache_Inval(int *list, int n, unsigned int epoch)
+{
+	if(n < 0){
+		memset(lcache, 0, sizeof(lcache));
+		memset(acache, 0, sizeof(acache));
+		Page_Forget(-1);
 	}
+	for(int i = 0; i < n; i++)
+		Cache_Forget(list[i]);
+	seen_epoch = epoch;
+}
 
-	struct sockaddr_in sock;
-	struct sockaddr_in sock1;
-	int rc = UDP_FillSockAddr(&sock, server, pnum);
+/* Cache_Reply: apply the invalidations piggybacked on a lookup, path or stat
+reply, then cache its answer for the lease. request is the encoded request. */
+void Cache_Reply(char *request, char *in, message_t *receive)
+{
+	wire_hdr_t *q = (wire_hdr_t*) request;
+	wire_hdr_t *h = (wire_hdr_t*) in;
+	if(h->op == MFS_READ)
+		read_lease = h->lease;
+	if(h->op == MFS_READDIR)
+		list_lease = h->lease;
+	if(h->op != MFS_LOOKUP && h->op != MFS_STAT && h->op != MFS_LOOKUP_PATH)
+		return;
+	int skip = h->op == MFS_LOOKUP_PATH ? h->nbytes : 0;
+	int n = h->flags & WIRE_INVAL ? (h->len - skip) / sizeof(int) : 0;
+	Cache_Inval((int*) (receive->buf + skip), h->flags & WIRE_FLUSH ? -1 : n, h->epoch);
+	if(h->lease <= 0)
+		return;
 
-	struct timeval tv;
-	tv.tv_usec=0; 
-	tv.tv_sec=3; 
+	long expires = now_us() + h->lease * 1000L;
+	if(h->op == MFS_LOOKUP){
+		char *name = request + sizeof(wire_hdr_t);
+		lentry_t *e = name_slot(q->inum, name);
+		e->valid = 1;
+		e->pinum = q->inum;
+		strncpy(e->name, name, 28);
+		e->inum = receive->node_num;
+		e->expires = expires;
+	}else if(h->op == MFS_LOOKUP_PATH){
+		// every component resolved: a lookup and a stat of each
+		wire_comp_t *c = (wire_comp_t*) receive->buf;
+		char *p = request + sizeof(wire_hdr_t);
+		char name[28];
+		int pinum = *p == '/' ? 0 : q->inum;
+		for(int i = 0; i < h->nbytes / sizeof(wire_comp_t) && Next_Name(&p, name) == 1; i++){
+			lentry_t *e = name_slot(pinum, name);
+			e->valid = 1;
+			e->pinum = pinum;
+			strncpy(e->name, name, 28);
+			e->inum = c[i].inum;
+			e->expires = expires;
+			aentry_t *a = &acache[(unsigned int) c[i].inum % ACACHE];
+			a->valid = 1;
+			a->inum = c[i].inum;
+			a->st.type = c[i].type;
+			a->st.size = c[i].size;
+			a->expires = expires;
+			pinum = c[i].inum;
+		}
+	}else if(receive->node_num == 0){
+		aentry_t *a = &acache[(unsigned int) q->inum % ACACHE];
+		a->valid = 1;
+		a->inum = q->inum;
+		a->st = receive->st;
+		a->expires = expires;
+	}
+}
 
-	if(rc < 0){
-                perror("upd_send: failed to find host");
-                return -1;
-        }
+/* new_reqid: id for the next request, distinct across client processes */
+unsigned int new_reqid()
+{
+	if(next_reqid == 0) next_reqid = (unsigned int) getpid() << 16;
+	return ++next_reqid;
+}
 
-	int timeout = 5;
-	fd_set set;
-	while(1){
-		// usf FDZERO on set
-		FD_ZERO(&set);
-		
-		// set set
-		FD_SET(sd,&set);
+/* Tcp_Lost: give up a broken connection; requests fail until MFS_Init reconnects */
+void Tcp_Lost()
+{
+	debug("In Tcp_Lost: connection to the server lost\n");
+	close(my_sd);
+	my_sd = -1;
+}
 
-		// Write using the udp_write funcction
-		UDP_Write(sd, &sock, (char*)send, sizeof(message_t));
+/* Tcp_Connect: connect my_sd to the server at my_addr
+returns: 0, or -1 if it cannot be reached
+*/
+int Tcp_Connect()
+{
+	int one = 1;
+	int bufsize = 1 << 20;
+	if((my_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+		perror("Tcp_Connect: failed to open socket");
+		return -1;
+	}
+	// room for a whole range read
+	setsockopt(my_sd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	if(connect(my_sd, (struct sockaddr*) &my_addr, sizeof(my_addr)) < 0){
+		perror("Tcp_Connect: failed to connect");
+		close(my_sd);
+		my_sd = -1;
+		return -1;
+	}
+	setsockopt(my_sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+/* Tcp_Reconnect: replace a connection the server has not answered on for
+TCP_WAIT with a new one. Replies come back in order, so every request still
+waiting on the old connection fails with it.
+returns: as Tcp_Connect
+*/
+int Tcp_Reconnect()
+{
+	char lost[MAX_INFLIGHT];
+	debug("In Tcp_Reconnect: no reply for too long, reconnecting\n");
+	close(my_sd);
+	my_sd = -1;
+	for(int i = 0; i < MAX_INFLIGHT; i++)
+		lost[i] = inflight != NULL && inflight[i].used;
+	int rc = Tcp_Connect();
+	// a completion may submit a request on the new connection
+	for(int i = 0; i < MAX_INFLIGHT; i++)
+		if(lost[i])
+			Complete(i, -1);
+	return rc;
+}
+
+/* Tcp_Write: write all of n iovecs (advanced as they go) to the connection
+returns: 0, or -1 if the connection broke
+*/
+int Tcp_Write(struct iovec *iov, int n)
+{
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	while(n > 0){
+		mh.msg_iov = iov;
+		mh.msg_iovlen = n;
+		ssize_t rc = sendmsg(my_sd, &mh, MSG_NOSIGNAL);
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc < 0){
+			Tcp_Lost();
+			return -1;
+		}
+		while(n > 0 && (size_t) rc >= iov->iov_len){
+			rc -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n > 0){
+			iov->iov_base = (char*) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return 0;
+}
+
+/* Tcp_Read: read exactly n bytes from the connection
+returns: 0, or -1 if the connection broke
+*/
+int Tcp_Read(void *buf, int n)
+{
+	for(int done = 0; done < n; ){
+		ssize_t rc = recv(my_sd, (char*) buf + done, n - done, MSG_WAITALL);
+		if(rc < 0 && errno == EINTR)
+			continue;
+		if(rc <= 0){
+			Tcp_Lost();
+			return -1;
+		}
+		done += rc;
+	}
+	return 0;
+}
 
-		// make sure this was successful
-		if(select(sd+1, &set, NULL, NULL, &tv)){
+/* Send_Datagram: send one request datagram gathered from iov[0] (the header,
+and any payload after it) and iov[1] (data sent from where it is, may be empty),
+as a frame if requests go over TCP */
+void Send_Datagram(struct iovec *iov)
+{
+	if(my_sd < 0)
+		return;
+	if(my_tcp){
+		unsigned int pre = htonl(iov[0].iov_len + iov[1].iov_len);
+		struct iovec v[3];
+		v[0].iov_base = &pre;
+		v[0].iov_len = sizeof(pre);
+		v[1] = iov[0];
+		v[2] = iov[1];
+		Tcp_Write(v, 3);
+		return;
+	}
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &my_addr;
+	mh.msg_namelen = sizeof(my_addr);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	sendmsg(my_sd, &mh, 0);
+}
 
-			// read using udp_read
-			rc = UDP_Read(sd, &sock1, (char*)receive, sizeof(message_t));
+/* Reply_Dest: where the data of reply h can be received directly, NULL if it
+is not the data of a read or listing somebody waits for */
+char *Reply_Dest(wire_hdr_t *h, int *cap)
+{
+	if(!(h->flags & WIRE_REPLY) || h->inum != 0 || h->len == 0
+		|| (h->op != MFS_READ && h->op != MFS_READ_RANGE && h->op != MFS_READDIR))
+		return NULL;
+	if(want_data != NULL && h->reqid == want_reqid){
+		int at = h->offset - want_start;
+		if(at < 0 || at % MFS_BLOCK_SIZE != 0 || at >= want_len)
+			return NULL;
+		// a TCP frame holds a whole range
+		*cap = want_len - at < MFS_BLOCK_SIZE || my_tcp ? want_len - at : MFS_BLOCK_SIZE;
+		return want_data + at;
+	}
+	for(int i = 0; h->op == MFS_READ && i < MAX_INFLIGHT && ninflight > 0; i++){
+		inflight_t *f = &inflight[i];
+		if(f->used && f->reqid == h->reqid && f->op == MFS_READ){
+			*cap = f->nbytes;
+			return f->buf;
+		}
+	}
+	return NULL;
+}
 
-			// check to make sure read was successful
-			if(rc > 0){
+/* Recv_Frame: Recv_Reply over TCP, one whole frame (see message.h), its
+data read straight into its destination where there is one */
+int Recv_Frame(char *in, message_t *receive, unsigned int *id)
+{
+	wire_hdr_t *h = (wire_hdr_t*) in;
+	unsigned int pre;
+	int flags;
+	if(Tcp_Read(&pre, sizeof(pre)) < 0)
+		return -1;
+	int len = (int) ntohl(pre) - (int) sizeof(wire_hdr_t);
+	if(len < 0 || len > WIRE_RANGE_MAX){
+		Tcp_Lost();
+		return -1;
+	}
+	if(Tcp_Read(in, sizeof(wire_hdr_t)) < 0)
+		return -1;
+	if(h->version != MFS_WIRE_VERSION || h->len != len){
+		Tcp_Lost();
+		return -1;
+	}
 
-				// close open port
-				UDP_Close(sd);
-				return 0;
+	int cap = 0;
+	char *dst = Reply_Dest(h, &cap);
+	if(dst != NULL && len <= cap){
+		if(Tcp_Read(dst, len) < 0)
+			return -1;
+		*id = h->reqid;
+		wire_fields(h, receive);
+		return 1;
+	}
+	if(len > (int) (sizeof(message_t) - sizeof(wire_hdr_t))){
+		// data nobody waits for any more
+		char skip[MFS_BLOCK_SIZE];
+		for(int n = 0; n < len; n += MFS_BLOCK_SIZE)
+			if(Tcp_Read(skip, len - n < MFS_BLOCK_SIZE ? len - n : MFS_BLOCK_SIZE) < 0)
+				return -1;
+		return -1;
+	}
+	if(Tcp_Read(in + sizeof(wire_hdr_t), len) < 0
+		|| wire_decode(in, sizeof(wire_hdr_t) + len, receive, id, &flags) < 0 || !(flags & WIRE_REPLY))
+		return -1;
+	return 0;
+}
+
+/* Recv_Reply: receive one reply datagram into in and decode it into receive
+
+The header is peeked at first, so that read data somebody waits for is
+received straight into its destination (see Reply_Dest) instead of in.
+returns: 1 if the data went to its destination, 0 if it is in receive,
+-1 if the datagram is not a valid reply
+*/
+int Recv_Reply(char *in, message_t *receive, unsigned int *id)
+{
+	wire_hdr_t h;
+	char *dst = NULL;
+	int cap = 0;
+	int flags;
+	if(my_tcp)
+		return Recv_Frame(in, receive, id);
+	if(recv(my_sd, &h, sizeof(h), MSG_PEEK) == sizeof(h) && h.version == MFS_WIRE_VERSION)
+		dst = Reply_Dest(&h, &cap);
+	if(dst == NULL){
+		struct sockaddr_in sock1;
+		int rc = UDP_Read(my_sd, &sock1, in, sizeof(message_t));
+		if(rc <= 0 || wire_decode(in, rc, receive, id, &flags) < 0 || !(flags & WIRE_REPLY))
+			return -1;
+		return 0;
+	}
+
+	struct iovec iov[2];
+	iov[0].iov_base = in;
+	iov[0].iov_len = sizeof(wire_hdr_t);
+	iov[1].iov_base = dst;
+	iov[1].iov_len = cap;
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	int rc = recvmsg(my_sd, &mh, 0);
+	wire_hdr_t *hp = (wire_hdr_t*) in;
+	if(rc < (int) sizeof(wire_hdr_t) || (mh.msg_flags & MSG_TRUNC)
+		|| hp->len != rc - sizeof(wire_hdr_t))
+		return -1;
+	*id = hp->reqid;
+	wire_fields(hp, receive);
+	return 1;
+}
+
+/* Exchange: send the nout datagrams of request reqid back-to-back and wait for its reply.
+
+Datagram i is gathered from out[2 * i] and out[2 * i + 1] (see Send_Datagram).
+If data is not NULL the reply is an MFS_READ, MFS_READ_RANGE or MFS_READDIR
+answer for up to want bytes from offset start, and its fragments land in
+data in whatever order they arrive, received there directly. The last
+reply datagram is left in receive. Replies to earlier, retried requests are
+skipped.
+
+The request is sent again whenever the server stays quiet for the
+retransmission timeout, which doubles each time (exponential backoff),
+and given up after MAX_RETRIES. Only exchanges answered without a resend
+update the round trip estimate (Karn's rule). Over TCP the connection does
+its own retransmission, so the request is only sent once, and a frame may
+hold every fragment of a range. It is waited for TCP_WAIT without backoff,
+and then given up along with the connection (see Tcp_Reconnect), so that
+its late reply cannot turn up in front of the next request's.
+returns: 0 once the whole reply is in, -1 on failure
+*/
+int Exchange(struct iovec *out, int nout, unsigned int reqid, message_t *receive,
+	char *data, int start, int want)
+{
+	if(my_sd < 0){
+		return -1;
+	}
+
+	struct timeval tv;
+
+	char *in = (char*) malloc(sizeof(message_t));
+	unsigned char have[WIRE_WINDOW];
+	memset(have, 0, sizeof(have));
+	int nfrags = want == 0 ? 1 : (want + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+	int got = 0;
+	int done = 0;
+
+	// a completion run from here may make a request of its own
+	unsigned int old_reqid = want_reqid;
+	char *old_data = want_data;
+	int old_start = want_start;
+	int old_len = want_len;
+	want_reqid = reqid;
+	want_data = data;
+	want_start = start;
+	want_len = want;
+
+	int tries = 0;
+	long sent = 0;
+	fd_set set;
+	while(!done && tries <= (my_tcp ? 0 : MAX_RETRIES) && my_sd >= 0){
+		// Write every datagram of the request
+		sent = now_us();
+		for(int i = 0; i < nout; i++)
+			Send_Datagram(&out[2 * i]);
+
+		// read replies until the server goes quiet, then send again
+		while(!done && my_sd >= 0){
+			long wait = my_tcp ? sent + TCP_WAIT - now_us() : rto;
+			if(wait < 0)
+				wait = 0;
+			FD_ZERO(&set);
+			FD_SET(my_sd,&set);
+			tv.tv_sec = wait / 1000000;
+			tv.tv_usec = wait % 1000000;
+			if(select(my_sd+1, &set, NULL, NULL, &tv) <= 0){
+				tries ++;
+				if(my_tcp){
+					Tcp_Reconnect();
+					break;
+				}
+
+				// back off before sending again
+				rto = rto * 2 > RTO_MAX ? RTO_MAX : rto * 2;
+				break;
+			}
+
+			// check to make sure read was successful and answers this request
+			unsigned int id;
+			int direct = Recv_Reply(in, receive, &id);
+			if(direct < 0)
+				continue;
+			if(id != reqid){
+				// may answer an asynchronous request
+				Async_Reply(id, in, receive, direct);
+				continue;
+			}
+			Cache_Reply((char*) out[0].iov_base, in, receive);
+			if(data == NULL || receive->node_num != 0){
+				done = 1;
+				continue;
 			}
-		}else{
 
-			// wait for one less second now
-			timeout --;
+			// one fragment of a range read; a listing may come back shorter
+			if(receive->st.size >= 0 && receive->st.size < want){
+				want = receive->st.size;
+				nfrags = want == 0 ? 1 : (want + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+			}
+			int k = (receive->offset - start) / MFS_BLOCK_SIZE;
+			if(receive->offset < start || (receive->offset - start) % MFS_BLOCK_SIZE != 0
+				|| k >= nfrags || have[k])
+				continue;
+			int n = want - k * MFS_BLOCK_SIZE;
+			if(!direct)
+				memcpy(data + k * MFS_BLOCK_SIZE, receive->buf, n < MFS_BLOCK_SIZE ? n : MFS_BLOCK_SIZE);
+			int last = direct && receive->nbytes > MFS_BLOCK_SIZE ? k + (receive->nbytes - 1) / MFS_BLOCK_SIZE : k;
+			for(; k <= last && k < nfrags; k++)
+				if(!have[k]){
+					have[k] = 1;
+					got++;
+				}
+			done = got == nfrags;
 		}
 	}
+	free(in);
+	want_reqid = old_reqid;
+	want_data = old_data;
+	want_start = old_start;
+	want_len = old_len;
+
+	if(!done){
+		debug("In Exchange: no reply to request %u after %d tries\n", reqid, tries);
+		return -1;
+	}
+	if(tries == 0)
+		rtt_sample(now_us() - sent);
+	return 0;
+}
+
+/* Send_Request: make request send, its write data (blen bytes) sent from body if
+that is not NULL, its read data received into data (see Exchange) if that is not NULL
+returns: as Exchange
+*/
+int Send_Request(message_t *send, char *body, int blen, message_t *receive, char *data, int start, int want)
+{
+	char out[WIRE_MAX];
+	struct iovec iov[2];
+	unsigned int reqid = new_reqid();
+	wire_hdr_t *h = (wire_hdr_t*) out;
+	int len;
+	if(body != NULL){
+		wire_header(send, send->msg, reqid, 0, h);
+		h->len = blen;
+		len = sizeof(wire_hdr_t);
+	}else{
+		len = wire_encode(send, send->msg, reqid, 0, out);
+	}
+	h->epoch = seen_epoch;
+	iov[0].iov_base = out;
+	iov[0].iov_len = len;
+	iov[1].iov_base = body;
+	iov[1].iov_len = body != NULL ? blen : 0;
+	return Exchange(iov, 1, reqid, receive, data, start, want);
+}
+
+/* Server_To_Client: Send file operation message to server and receive feedback.
+
+Use message_t struct for messages. They travel in the compact wire format
+(see message.h).
+*/
+int Server_To_Client(message_t *send, message_t *receive)
+{
+	return Send_Request(send, NULL, 0, receive, NULL, 0, 0);
 }
 
-// important global variables
-char* my_serv = NULL; // server being used
-int working = 0; // make sure the server is currently working
-int prt = 10000; // base port
 
+/* MFS_Init: set up server and port, and the socket all requests go through
 
-/* MFS_Init: set up server and port */
+A hostname of "tcp://host" sends them over one TCP connection to a server
+started with -T instead of as UDP datagrams (see message.h).
+returns: 0 on success, -1 on failure
+*/
 int MFS_Init(char *hostname, int port) {
+	int tcp = strncmp(hostname, WIRE_TCP, strlen(WIRE_TCP)) == 0;
 	prt = port;
+	free(my_serv);
+	my_serv = strdup(tcp ? hostname + strlen(WIRE_TCP) : hostname); 
+	if(UDP_FillSockAddr(&my_addr, my_serv, prt) < 0){
+		perror("MFS_Init: failed to find host");
+		return -1;
+	}
+	// a connection is never shared, not even with a forked child
+	if(my_sd >= 0 && (tcp || my_tcp)){
+		close(my_sd);
+		my_sd = -1;
+	}
+	my_tcp = tcp;
+	if(my_tcp){
+		if(Tcp_Connect() < 0)
+			return -1;
+		working = 1;
+		return 0;
+	}
+	if(my_sd < 0 && (my_sd = UDP_Open(0)) < 0){
+		perror("MFS_Init: failed to open socket");
+		return -1;
+	}
+
+	// room for a whole window of reply fragments
+	int bufsize = 1 << 20;
+	setsockopt(my_sd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
 	working = 1;
-	my_serv = strdup(hostname); 
 	return 0;
 }
 
@@ -95,6 +754,12 @@ int MFS_Lookup(int pinum, char *name){
 		return -1;
 	}
 
+	Wb_Tick();
+	lentry_t *e = Cache_Find(pinum, name);
+	if(e != NULL){
+		return e->inum;
+	}
+
 	message_t send;
 
 	send.node_num = pinum;
@@ -108,7 +773,7 @@ int MFS_Lookup(int pinum, char *name){
 
 	message_t receive;
 
-	int ret = Server_To_Client( &send, &receive, my_serv, prt);
+	int ret = Server_To_Client( &send, &receive);
 	debug("In MFS_Lookup: server retcode %d, received inum %d\n", ret, receive.node_num);
 		
 	if(ret <= -1){
@@ -120,6 +785,241 @@ int MFS_Lookup(int pinum, char *name){
 	}
 }
 
+/* Path_Cached: resolve a path from the lookup cache alone, and the stats of
+its first max components into st (if not NULL) from the attribute cache
+returns: the final inum, -1 if a component is known to be missing, -2 if
+something is not cached
+*/
+int Path_Cached(int inum, char *path, MFS_Stat_t *st, int max)
+{
+	char name[28];
+	long now = now_us();
+	if(*path == '/')
+		inum = 0;
+	int rc;
+	for(int n = 0; (rc = Next_Name(&path, name)) == 1; n++){
+		lentry_t *e = Cache_Find(inum, name);
+		if(e == NULL)
+			return -2;
+		if(e->inum == -1)
+			return -1;
+		inum = e->inum;
+		if(st != NULL && n < max){
+			aentry_t *a = &acache[(unsigned int) inum % ACACHE];
+			if(!a->valid || a->inum != inum || now >= a->expires)
+				return -2;
+			st[n] = a->st;
+		}
+	}
+	return rc < 0 ? -1 : inum;
+}
+
+/* MFS_Lookup_Path: resolve a whole path in one request, see mfs.h */
+int MFS_Lookup_Path(int pinum, char *path, MFS_Stat_t *st, int max){
+	debug("In MFS_Lookup_Path: entering ...\n");
+	if(path == NULL || strlen(path) >= MFS_BLOCK_SIZE){
+		return -1;
+	}
+	Wb_Tick();
+	if(st != NULL)
+		Wb_Flush(-1); // sizes must include held writes
+	int inum = Path_Cached(pinum, path, st, max);
+	if(inum != -2){
+		return inum;
+	}
+
+	message_t send;
+	send.msg = MFS_LOOKUP_PATH;
+	send.node_num = pinum;
+	send.nbytes = strlen(path) + 1;
+	memcpy(send.buf, path, send.nbytes);
+
+	if(!working){
+		return -1;
+	}
+
+	message_t receive;
+
+	if(Server_To_Client(&send, &receive) <= -1 || receive.node_num == -1){
+		return -1;
+	}
+	wire_comp_t *c = (wire_comp_t*) receive.buf;
+	for(int i = 0; st != NULL && i < max && i < receive.nbytes / sizeof(wire_comp_t); i++){
+		st[i].type = c[i].type;
+		st[i].size = c[i].size;
+	}
+
+	debug("In MFS_Lookup_Path: inum %d. returning ...\n", receive.node_num);
+	return receive.node_num;
+}
+
+/* MFS_Compound: run a batch of operations in one request, see mfs.h
+returns: 0 if every operation succeeded, -1 if one failed or the batch is too big
+*/
+int MFS_Compound(MFS_Op_t *ops, int n){
+	debug("In MFS_Compound: %d operations. entering ...\n", n);
+	if(n < 0 || n > WIRE_OPS_MAX || !working){
+		return -1;
+	}
+	Wb_Flush(-1);
+
+	message_t send;
+	int len = 0;
+	int want = 0;
+	for(int i = 0; i < n; i++){
+		MFS_Op_t *x = &ops[i];
+		wire_op_t o;
+		if(x->ref >= i)
+			return -1;
+		o.op = x->op;
+		o.ref = x->ref;
+		o.inum = x->inum;
+		o.offset = x->offset;
+		o.nbytes = x->nbytes;
+		o.arg = x->type;
+		o.len = 0;
+		if(x->op == MFS_OP_LOOKUP || x->op == MFS_OP_CREAT || x->op == MFS_OP_UNLINK){
+			if(x->name == NULL || strlen(x->name) > 27)
+				return -1;
+			o.len = strlen(x->name) + 1;
+		}else if(x->op == MFS_OP_WRITE){
+			if(x->nbytes < 0)
+				return -1;
+			o.len = x->nbytes;
+		}else if(x->op == MFS_OP_READ){
+			if(x->nbytes < 0)
+				return -1;
+			want += x->nbytes;
+		}else if(x->op != MFS_OP_STAT){
+			return -1;
+		}
+		want += sizeof(wire_res_t);
+		if(len + sizeof(o) + o.len > MFS_BLOCK_SIZE || want > MFS_BLOCK_SIZE)
+			return -1;
+		memcpy(send.buf + len, &o, sizeof(o));
+		if(o.len > 0)
+			memcpy(send.buf + len + sizeof(o), x->op == MFS_OP_WRITE ? x->buf : x->name, o.len);
+		len += sizeof(o) + o.len;
+		x->rc = -1;
+		x->result = -1;
+	}
+	send.msg = MFS_COMPOUND;
+	send.node_num = 0;
+	send.nbytes = len;
+
+	message_t receive;
+	if(Server_To_Client(&send, &receive) <= -1){
+		return -1;
+	}
+
+	int at = 0;
+	for(int i = 0; i < n && at + sizeof(wire_res_t) <= receive.nbytes; i++){
+		MFS_Op_t *x = &ops[i];
+		wire_res_t r;
+		memcpy(&r, receive.buf + at, sizeof(r));
+		at += sizeof(r);
+		x->rc = r.rc;
+		x->result = r.inum;
+		int inum = x->ref >= 0 ? ops[x->ref].result : x->inum;
+		if(x->op == MFS_OP_STAT){
+			x->st.type = r.type;
+			x->st.size = r.size;
+		}else if(x->op == MFS_OP_READ){
+			memcpy(x->buf, receive.buf + at, r.len);
+			at += r.len;
+		}else if(x->op == MFS_OP_WRITE){
+			acache[(unsigned int) inum % ACACHE].valid = 0;
+			Page_Forget(inum);
+		}else if(x->op == MFS_OP_CREAT){
+			Cache_Forget(inum);
+		}else if(x->op == MFS_OP_UNLINK){
+			Forget_Name(inum, x->name);
+		}
+	}
+
+	debug("In MFS_Compound: ret %d. returning ...\n", receive.node_num);
+	return receive.node_num;
+}
+
+/* MFS_Readdir: list a directory from a cookie, a window of entries per request, see mfs.h
+
+The names (and, with st, the stats) listed go into the lookup and attribute
+caches for the lease that comes with the listing.
+returns: number of entries listed, 0 once the listing is complete, -1 on failure
+*/
+int MFS_Readdir(int inum, MFS_Cookie_t *cookie, MFS_DirEnt_t *ents, MFS_Stat_t *st, int max){
+	debug("In MFS_Readdir: entering ...\n");
+	if(cookie == NULL || max <= 0 || !working){
+		return -1;
+	}
+	Wb_Tick();
+	if(st != NULL)
+		Wb_Flush(-1); // sizes must include held writes
+	int per = (WIRE_RANGE_MAX - WIRE_DIRINVAL_MAX) / sizeof(wire_dirent_t);
+	char *buf = (char*) malloc(WIRE_RANGE_MAX);
+	message_t send;
+	message_t receive;
+	int n = 0;
+
+	while(n < max && cookie->pos != -1){
+		int want = WIRE_DIRINVAL_MAX + (max - n < per ? max - n : per) * sizeof(wire_dirent_t);
+		send.msg = MFS_READDIR;
+		send.node_num = inum;
+		send.offset = cookie->pos;
+		send.nbytes = want;
+		send.mtype = st != NULL;
+		strncpy(send.name, cookie->name, 28);
+		send.name[27] = '\0';
+		if(Send_Request(&send, NULL, 0, &receive, buf, 0, want) <= -1
+			|| receive.node_num != 0 || receive.st.size < (int) sizeof(wire_inval_t)){
+			free(buf);
+			return -1;
+		}
+
+		// what changed since our epoch goes before the listing fills the caches
+		wire_inval_t *inv = (wire_inval_t*) buf;
+		int pre = sizeof(wire_inval_t) + (inv->n > 0 ? inv->n : 0) * sizeof(int);
+		if(inv->n > WIRE_INVAL_MAX || receive.st.size < pre){
+			free(buf);
+			return -1;
+		}
+		Cache_Inval((int*) (inv + 1), inv->n, inv->epoch);
+		wire_dirent_t *w = (wire_dirent_t*) (buf + pre);
+		int got = (receive.st.size - pre) / sizeof(wire_dirent_t);
+		long expires = now_us() + list_lease * 1000L;
+		for(int i = 0; i < got; i++, n++){
+			memcpy(ents[n].name, w[i].name, 28);
+			ents[n].inum = w[i].inum;
+			if(st != NULL){
+				st[n].type = w[i].type;
+				st[n].size = w[i].size;
+			}
+			if(list_lease <= 0)
+				continue;
+			lentry_t *e = name_slot(inum, w[i].name);
+			e->valid = 1;
+			e->pinum = inum;
+			strncpy(e->name, w[i].name, 28);
+			e->inum = w[i].inum;
+			e->expires = expires;
+			if(st != NULL && w[i].type != -1){
+				aentry_t *a = &acache[(unsigned int) w[i].inum % ACACHE];
+				a->valid = 1;
+				a->inum = w[i].inum;
+				a->st = st[n];
+				a->expires = expires;
+			}
+		}
+		if(got > 0)
+			memcpy(cookie->name, w[got - 1].name, 28);
+		cookie->pos = receive.st.type;
+	}
+
+	free(buf);
+	debug("In MFS_Readdir: %d entries. returning ...\n", n);
+	return n;
+}
+
 /* MFS_Stat: takes inum 
 returns: 0 on success, 1 on failure
 
@@ -127,6 +1027,14 @@ Fills up stat of a file
 */
 int MFS_Stat(int inum, MFS_Stat_t *m) {
 	debug("In MFS_Stat: entering ...\n");
+	Wb_Tick();
+	Wb_Flush(inum);
+	aentry_t *a = &acache[(unsigned int) inum % ACACHE];
+	if(a->valid && a->inum == inum && now_us() < a->expires){
+		*m = a->st;
+		return 0;
+	}
+
 	message_t send;
 	send.msg = MFS_STAT;
 	send.node_num = inum;
@@ -137,7 +1045,7 @@ int MFS_Stat(int inum, MFS_Stat_t *m) {
 
 	message_t receive;
 
-	if(Server_To_Client(&send, &receive, my_serv, prt) <= -1){
+	if(Server_To_Client(&send, &receive) <= -1){
 		return -1;
 	}
 	if (receive.node_num == -1) return -1;
@@ -149,17 +1057,75 @@ int MFS_Stat(int inum, MFS_Stat_t *m) {
 	return 0;
 }
 
-int MFS_Write(int inum, char *buffer, int offset, int nbytes){
-	debug("In MFS_Write. entering ...\n");
-	if (offset < 0 || nbytes > 4096) {
-		return -1;
+/* Write_Range: MFS_Write of more than one block, one window of fragments at a time
+returns: 0 on success, -1 on failure
+*/
+int Write_Range(int inum, char *buffer, int offset, int nbytes){
+	wire_hdr_t hdr[WIRE_WINDOW];
+	struct iovec out[2 * WIRE_WINDOW];
+	message_t send;
+	message_t receive;
+
+	int rc = 0;
+	for(int w = 0; w < nbytes && rc == 0; w += WIRE_RANGE_MAX){
+		int wlen = nbytes - w < WIRE_RANGE_MAX ? nbytes - w : WIRE_RANGE_MAX;
+		int nout = (wlen + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+		unsigned int reqid = new_reqid();
+		for(int k = 0; k < nout; k++){
+			int n = wlen - k * MFS_BLOCK_SIZE;
+			send.msg = MFS_WRITE_RANGE;
+			send.node_num = inum;
+			send.offset = offset + w + k * MFS_BLOCK_SIZE;
+			send.nbytes = n < MFS_BLOCK_SIZE ? n : MFS_BLOCK_SIZE;
+			send.mtype = wlen;
+			send.st.size = offset + w;
+			// each fragment's data goes out from buffer itself
+			wire_header(&send, MFS_WRITE_RANGE, reqid, 0, &hdr[k]);
+			hdr[k].len = send.nbytes;
+			out[2 * k].iov_base = &hdr[k];
+			out[2 * k].iov_len = sizeof(wire_hdr_t);
+			out[2 * k + 1].iov_base = buffer + w + k * MFS_BLOCK_SIZE;
+			out[2 * k + 1].iov_len = send.nbytes;
+		}
+		if(Exchange(out, nout, reqid, &receive, NULL, 0, 0) <= -1)
+			rc = -1;
+		else
+			rc = receive.node_num;
 	}
+	return rc;
+}
 
+/* Read_Range: MFS_Read of more than one block, one window at a time
+returns: 0 on success, -1 on failure
+*/
+int Read_Range(int inum, char *buffer, int offset, int nbytes){
 	message_t send;
+	message_t receive;
 
-  	for(int i = 0; i<4096; i++){
-        send.buf[i] = buffer[i];
-    }
+	for(int w = 0; w < nbytes; w += WIRE_RANGE_MAX){
+		int wlen = nbytes - w < WIRE_RANGE_MAX ? nbytes - w : WIRE_RANGE_MAX;
+		send.msg = MFS_READ_RANGE;
+		send.node_num = inum;
+		send.offset = offset + w;
+		send.nbytes = wlen;
+		if(Send_Request(&send, NULL, 0, &receive, buffer + w, offset + w, wlen) <= -1
+			|| receive.node_num != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Write_Now: send a write to the server, bypassing the write-back buffers */
+int Write_Now(int inum, char *buffer, int offset, int nbytes){
+	acache[(unsigned int) inum % ACACHE].valid = 0;
+	Page_Forget(inum);
+	if (nbytes > MFS_BLOCK_SIZE) {
+		if(!working)
+			return -1;
+		return Write_Range(inum, buffer, offset, nbytes);
+	}
+
+	message_t send;
 
 	send.nbytes = nbytes;
 	send.msg = MFS_WRITE;
@@ -172,7 +1138,8 @@ int MFS_Write(int inum, char *buffer, int offset, int nbytes){
 	
 	message_t receive;
 
-	if(Server_To_Client(&send, &receive, my_serv, prt) <= -1){
+	// the data goes out from buffer itself
+	if(Send_Request(&send, buffer, nbytes, &receive, NULL, 0, 0) <= -1){
 		return -1;
 	}
 
@@ -180,11 +1147,277 @@ int MFS_Write(int inum, char *buffer, int offset, int nbytes){
 	return receive.node_num;
 }
 
+/* Wb_Send: send the writes held in w and free it */
+void Wb_Send(wbuf_t *w)
+{
+	// detached first: a completion run while sending may write again
+	wbuf_t held = *w;
+	w->used = 0;
+	for(int i = 0; i < held.n; i++){
+		extent_t *x = &held.ext[i];
+		if(Write_Now(held.inum, x->data, x->offset, x->len) != 0)
+			wb_error = 1;
+		free(x->data);
+	}
+}
+
+/* Wb_Flush: send what is held for inum, or for every file if inum is -1 */
+void Wb_Flush(int inum)
+{
+	for(int i = 0; write_back && i < WB_FILES; i++)
+		if(wbufs[i].used && (inum == -1 || wbufs[i].inum == inum))
+			Wb_Send(&wbufs[i]);
+}
+
+/* Wb_Tick: send the files whose oldest held write has waited WB_MS */
+void Wb_Tick()
+{
+	long now = now_us();
+	for(int i = 0; write_back && i < WB_FILES; i++)
+		if(wbufs[i].used && now - wbufs[i].since >= WB_MS * 1000L)
+			Wb_Send(&wbufs[i]);
+}
+
+/* Wb_Add: hold a write, merged with the held extents it overlaps or touches
+returns: 0, or -1 if out of memory
+*/
+int Wb_Add(int inum, char *buffer, int offset, int nbytes)
+{
+	wbuf_t *w = NULL;
+	wbuf_t *old = NULL;
+	for(int i = 0; i < WB_FILES && w == NULL; i++){
+		if(wbufs[i].used && wbufs[i].inum == inum)
+			w = &wbufs[i];
+		else if(old == NULL || (old->used && (!wbufs[i].used || wbufs[i].since < old->since)))
+			old = &wbufs[i];
+	}
+	if(w == NULL){
+		if(old->used)
+			Wb_Send(old);
+		w = old;
+		w->used = 1;
+		w->inum = inum;
+		w->since = now_us();
+		w->bytes = 0;
+		w->n = 0;
+	}
+
+	int lo = offset;
+	int hi = offset + nbytes;
+	int merged = 0;
+	for(int i = 0; i < w->n; i++){
+		extent_t *x = &w->ext[i];
+		if(x->offset <= hi && x->offset + x->len >= lo){
+			if(x->offset < lo) lo = x->offset;
+			if(x->offset + x->len > hi) hi = x->offset + x->len;
+			merged++;
+		}
+	}
+	if(merged == 0 && w->n == WB_EXTENTS){
+		Wb_Send(w);
+		return Wb_Add(inum, buffer, offset, nbytes);
+	}
+	char *data = (char*) malloc(hi - lo > 0 ? hi - lo : 1);
+	if(data == NULL)
+		return -1;
+	for(int i = 0; i < w->n; i++){
+		extent_t *x = &w->ext[i];
+		if(x->offset <= hi && x->offset + x->len >= lo){
+			memcpy(data + x->offset - lo, x->data, x->len);
+			w->bytes -= x->len;
+			free(x->data);
+			w->ext[i--] = w->ext[--w->n];
+		}
+	}
+	memcpy(data + offset - lo, buffer, nbytes);
+	w->ext[w->n].offset = lo;
+	w->ext[w->n].len = hi - lo;
+	w->ext[w->n++].data = data;
+	w->bytes += hi - lo;
+	if(w->bytes >= WB_BYTES)
+		Wb_Send(w);
+	return 0;
+}
+
+int MFS_Write(int inum, char *buffer, int offset, int nbytes){
+	debug("In MFS_Write. entering ...\n");
+	if (offset < 0 || nbytes < 0) {
+		return -1;
+	}
+	if(!write_back)
+		return Write_Now(inum, buffer, offset, nbytes);
+	if(!working)
+		return -1;
+	Wb_Tick();
+	return Wb_Add(inum, buffer, offset, nbytes);
+}
+
+/* MFS_WriteBack: turn write-back buffering on or off, sending what is held when off
+returns: as MFS_Fsync
+*/
+int MFS_WriteBack(int on){
+	int rc = MFS_Fsync(-1);
+	write_back = on;
+	return rc;
+}
+
+/* MFS_Fsync: send the writes held for inum (every file if -1) and wait for them
+returns: 0, or -1 if any held write failed since the last call
+*/
+int MFS_Fsync(int inum){
+	Wb_Flush(inum);
+	int rc = wb_error ? -1 : 0;
+	wb_error = 0;
+	return rc;
+}
+
+
+/* Page_Find: the page holding block blk of inum, loaded or on its way, NULL if none */
+page_t *Page_Find(int inum, int blk)
+{
+	for(int i = 0; pages != NULL && i < NPAGES; i++){
+		page_t *p = &pages[i];
+		if(p->inum != inum || p->blk != blk)
+			continue;
+		if(p->state == PAGE_LOADING || (p->state == PAGE_VALID && now_us() < p->expires))
+			return p;
+	}
+	return NULL;
+}
+
+/* Page_Forget: drop the cached blocks of inum, or of every file if inum is -1 */
+void Page_Forget(int inum)
+{
+	for(int i = 0; pages != NULL && i < NPAGES; i++){
+		page_t *p = &pages[i];
+		if(inum != -1 && p->inum != inum)
+			continue;
+		if(p->state == PAGE_VALID)
+			p->state = PAGE_FREE;
+		else if(p->state == PAGE_LOADING)
+			p->state = PAGE_STALE;
+	}
+	for(int i = 0; i < NSTREAMS; i++)
+		if(inum == -1 || streams[i].inum == inum)
+			streams[i].run = 0;
+}
+
+/* Page_Done: completion of the async read filling a page */
+void Page_Done(int id, int result, void *arg)
+{
+	page_t *p = (page_t*) arg;
+	if(p->id != id)
+		return;
+	if(p->state == PAGE_LOADING && result == 0 && read_lease > 0){
+		p->state = PAGE_VALID;
+		p->expires = now_us() + read_lease * 1000L;
+	}else{
+		p->state = PAGE_FREE;
+	}
+}
+
+/* Page_Load: start reading block blk of inum into the cache, unless it is there already */
+void Page_Load(int inum, int blk)
+{
+	if(Page_Find(inum, blk) != NULL)
+		return;
+	if(pages == NULL && (pages = (page_t*) calloc(NPAGES, sizeof(page_t))) == NULL)
+		return;
+
+	// a free page, else the least recently used loaded one
+	page_t *p = NULL;
+	long now = now_us();
+	for(int i = 0; i < NPAGES; i++){
+		page_t *c = &pages[i];
+		if(c->state == PAGE_FREE || (c->state == PAGE_VALID && now >= c->expires)){
+			p = c;
+			break;
+		}
+		if(c->state == PAGE_VALID && (p == NULL || c->used < p->used))
+			p = c;
+	}
+	if(p == NULL)
+		return;
+	p->state = PAGE_LOADING;
+	p->inum = inum;
+	p->blk = blk;
+	p->used = ++page_clock;
+	p->id = -1;
+	int id = MFS_Read_Async(inum, p->data, blk * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE, Page_Done, p);
+	if(id < 0)
+		p->state = PAGE_FREE;
+	else
+		p->id = id;
+}
+
+/* Page_Read: MFS_Read served from the page cache
+A read that continues where the last one on the file stopped is
+sequential; after two of those the next READ_AHEAD blocks are prefetched
+asynchronously, stopping at the end of the file when its size is cached.
+returns: 0 on success, -2 if the cache cannot serve the read (the caller
+then asks the server directly)
+*/
+int Page_Read(int inum, char *buffer, int offset, int nbytes)
+{
+	if(read_lease <= 0 || nbytes == 0)
+		return -2;
+	int first = offset / MFS_BLOCK_SIZE;
+	int last = (offset + nbytes - 1) / MFS_BLOCK_SIZE;
+
+	stream_t *sr = &streams[(unsigned int) inum % NSTREAMS];
+	if(sr->inum == inum && sr->next == offset){
+		sr->run++;
+	}else{
+		sr->inum = inum;
+		sr->run = 0;
+	}
+	sr->next = offset + nbytes;
+
+	for(int b = first; b <= last; b++)
+		Page_Load(inum, b);
+	if(sr->run >= 1){
+		aentry_t *a = &acache[(unsigned int) inum % ACACHE];
+		int size = a->valid && a->inum == inum && now_us() < a->expires ? a->st.size : -1;
+		for(int b = last + 1; b <= last + READ_AHEAD; b++){
+			if(size >= 0 && b * MFS_BLOCK_SIZE >= size)
+				break;
+			Page_Load(inum, b);
+		}
+	}
+
+	for(int b = first; b <= last; b++){
+		page_t *p = Page_Find(inum, b);
+		while(p != NULL && p->state == PAGE_LOADING){
+			if(MFS_Poll(-1) < 0)
+				return -2;
+			p = Page_Find(inum, b);
+		}
+		if(p == NULL)
+			return -2;
+		p->used = ++page_clock;
+		int from = b == first ? offset % MFS_BLOCK_SIZE : 0;
+		int to = b == last ? (offset + nbytes - 1) % MFS_BLOCK_SIZE + 1 : MFS_BLOCK_SIZE;
+		memcpy(buffer + (b * MFS_BLOCK_SIZE + from - offset), p->data + from, to - from);
+	}
+	return 0;
+}
 
 int MFS_Read(int inum, char *buffer, int offset, int nbytes){	
 	debug("In MFS_Read: entering ...\n");
-	if (offset < 0 || nbytes > 4096)
+	if (offset < 0 || nbytes < 0)
 		return -1;
+	Wb_Tick();
+	Wb_Flush(inum);
+	if (nbytes > MFS_BLOCK_SIZE) {
+		if(!working)
+			return -1;
+		return Read_Range(inum, buffer, offset, nbytes);
+	}
+	if(working){
+		int rc = Page_Read(inum, buffer, offset, nbytes);
+		if(rc != -2)
+			return rc;
+	}
 		
 	message_t send;
 
@@ -199,16 +1432,11 @@ int MFS_Read(int inum, char *buffer, int offset, int nbytes){
 
 	message_t receive;
 
-	if(Server_To_Client(&send, &receive, my_serv, prt) <= -1){
+	// the data is received straight into buffer
+	if(Send_Request(&send, NULL, 0, &receive, buffer, offset, nbytes) <= -1){
 		return -1;
 	}
 
-	if(receive.node_num == 0) {
-		for(int i = 0; i < nbytes; i++){
-			buffer[i] = receive.buf[i];
-		}
-	}
-
 	debug("In MFS_Read: ret %d. returning ... \n", receive.node_num);
 	return receive.node_num;
 }
@@ -219,6 +1447,7 @@ int MFS_Creat(int pinum, int type, char *name){
 	if(name == NULL || strlen(name) > 28){
 		return -1;
 	}
+	Cache_Forget(pinum);
 
 	message_t send;
 
@@ -235,7 +1464,7 @@ int MFS_Creat(int pinum, int type, char *name){
 	
 	message_t receive;
 
-	if(Server_To_Client(&send, &receive, my_serv, prt) <= -1){
+	if(Server_To_Client(&send, &receive) <= -1){
 		return -1;
 	}
 
@@ -250,6 +1479,8 @@ int MFS_Unlink(int pinum, char *name){
 	if(name == NULL || strlen(name) > 28){
 		return -1;
 	}
+	Forget_Name(pinum, name);
+	Wb_Flush(-1); // before its inode number can be reused
 
 	// sending message
 	message_t send;
@@ -268,7 +1499,7 @@ int MFS_Unlink(int pinum, char *name){
 	message_t receive;
 
 	// actually send!	
-	if(Server_To_Client(&send, &receive, my_serv, prt) <= -1){
+	if(Server_To_Client(&send, &receive) <= -1){
 		return -1;
 	}
 
@@ -278,14 +1509,264 @@ int MFS_Unlink(int pinum, char *name){
 
 int MFS_Shutdown(){
 	debug("In MFS_Shutdown. entering ... \n");
+	Wb_Flush(-1);
 	message_t send;
 	send.msg = MFS_SHUTDOWN;
 	message_t receive;
 
-	if(Server_To_Client(&send, &receive, my_serv, prt) <= -1){
+	if(Server_To_Client(&send, &receive) <= -1){
 		return -1;
 	}
+	if(my_tcp)
+		close(my_sd);
+	else
+		UDP_Close(my_sd);
+	my_sd = -1;
 
 	debug("In MFS_Shutdown. returning ...\n");
 	return 0;
 }
+
+/* Complete: retire in-flight request i with result and tell its submitter */
+void Complete(int i, int result)
+{
+	inflight_t *f = &inflight[i];
+	MFS_Done_t done = f->done;
+	void *arg = f->arg;
+	int id = (int) (f->reqid & 0x7fffffff);
+	f->used = 0;
+	ninflight--;
+	ncompleted++;
+	if(done != NULL)
+		done(id, result, arg);
+}
+
+/* Async_Reply: finish the asynchronous request a reply belongs to, if any */
+void Async_Reply(unsigned int reqid, char *in, message_t *receive, int direct)
+{
+	for(int i = 0; i < MAX_INFLIGHT && ninflight > 0; i++){
+		inflight_t *f = &inflight[i];
+		if(!f->used || f->reqid != reqid)
+			continue;
+		if(f->tries == 0)
+			rtt_sample(now_us() - f->sent);
+		Cache_Reply(f->out, in, receive);
+		int result = receive->node_num;
+		if(f->op == MFS_STAT && result != -1){
+			f->st->type = receive->st.type;
+			f->st->size = receive->st.size;
+			result = 0;
+		}
+		if(f->op == MFS_READ && result == 0 && !direct)
+			memcpy(f->buf, receive->buf, f->nbytes);
+		Complete(i, result);
+		return;
+	}
+}
+
+/* Async_Send: send in-flight request f, a write's data straight from the caller's buffer */
+void Async_Send(inflight_t *f)
+{
+	struct iovec iov[2] = { { f->out, f->len }, { f->buf, f->op == MFS_WRITE ? f->nbytes : 0 } };
+	Send_Datagram(iov);
+}
+
+/* Submit: send an asynchronous request without waiting for its reply
+Waits in MFS_Poll while MAX_INFLIGHT requests are already outstanding.
+returns: request id, -1 on failure
+*/
+int Submit(message_t *send, MFS_Stat_t *st, char *buf, MFS_Done_t done, void *arg)
+{
+	if(!working || my_sd < 0){
+		return -1;
+	}
+	if(inflight == NULL && (inflight = (inflight_t*) calloc(MAX_INFLIGHT, sizeof(inflight_t))) == NULL){
+		return -1;
+	}
+	while(ninflight == MAX_INFLIGHT)
+		MFS_Poll(-1);
+
+	int i = 0;
+	while(inflight[i].used)
+		i++;
+	inflight_t *f = &inflight[i];
+	f->used = 1;
+	f->reqid = new_reqid();
+	f->op = send->msg;
+	if(f->op == MFS_WRITE){
+		wire_header(send, send->msg, f->reqid, 0, (wire_hdr_t*) f->out);
+		((wire_hdr_t*) f->out)->len = send->nbytes;
+		f->len = sizeof(wire_hdr_t);
+	}else{
+		f->len = wire_encode(send, send->msg, f->reqid, 0, f->out);
+	}
+	((wire_hdr_t*) f->out)->epoch = seen_epoch;
+	f->tries = 0;
+	f->st = st;
+	f->buf = buf;
+	f->nbytes = send->nbytes;
+	f->done = done;
+	f->arg = arg;
+	ninflight++;
+	f->sent = now_us();
+	Async_Send(f);
+	return (int) (f->reqid & 0x7fffffff);
+}
+
+int MFS_Lookup_Async(int pinum, char *name, MFS_Done_t done, void *arg){
+	if(name == NULL || strlen(name) > 28){
+		return -1;
+	}
+	message_t send;
+	send.msg = MFS_LOOKUP;
+	send.node_num = pinum;
+	strcpy(send.name, name);
+	return Submit(&send, NULL, NULL, done, arg);
+}
+
+int MFS_Stat_Async(int inum, MFS_Stat_t *m, MFS_Done_t done, void *arg){
+	Wb_Flush(inum);
+	message_t send;
+	send.msg = MFS_STAT;
+	send.node_num = inum;
+	return Submit(&send, m, NULL, done, arg);
+}
+
+int MFS_Write_Async(int inum, char *buffer, int offset, int nbytes, MFS_Done_t done, void *arg){
+	if (offset < 0 || nbytes < 0 || nbytes > MFS_BLOCK_SIZE) {
+		return -1;
+	}
+	Wb_Flush(inum);
+	acache[(unsigned int) inum % ACACHE].valid = 0;
+	Page_Forget(inum);
+	message_t send;
+	send.msg = MFS_WRITE;
+	send.node_num = inum;
+	send.offset = offset;
+	send.nbytes = nbytes;
+	return Submit(&send, NULL, buffer, done, arg);
+}
+
+int MFS_Read_Async(int inum, char *buffer, int offset, int nbytes, MFS_Done_t done, void *arg){
+	if (offset < 0 || nbytes < 0 || nbytes > MFS_BLOCK_SIZE) {
+		return -1;
+	}
+	Wb_Flush(inum);
+	message_t send;
+	send.msg = MFS_READ;
+	send.node_num = inum;
+	send.offset = offset;
+	send.nbytes = nbytes;
+	return Submit(&send, NULL, buffer, done, arg);
+}
+
+int MFS_Creat_Async(int pinum, int type, char *name, MFS_Done_t done, void *arg){
+	if(name == NULL || strlen(name) > 28){
+		return -1;
+	}
+	Cache_Forget(pinum);
+	message_t send;
+	send.msg = MFS_CREAT;
+	send.node_num = pinum;
+	send.mtype = type;
+	strcpy(send.name, name);
+	return Submit(&send, NULL, NULL, done, arg);
+}
+
+int MFS_Unlink_Async(int pinum, char *name, MFS_Done_t done, void *arg){
+	if(name == NULL || strlen(name) > 28){
+		return -1;
+	}
+	Forget_Name(pinum, name);
+	Wb_Flush(-1);
+	message_t send;
+	send.msg = MFS_UNLINK;
+	send.node_num = pinum;
+	strcpy(send.name, name);
+	return Submit(&send, NULL, NULL, done, arg);
+}
+
+/* MFS_Poll: collect replies to asynchronous requests, in whatever order they come
+
+Waits up to timeout_ms (forever if negative) for at least one request to
+finish, resending overdue requests with the same backoff as the
+synchronous calls; a request out of retries finishes with -1.
+returns: number of requests finished, -1 if none were in flight
+*/
+int MFS_Poll(int timeout_ms){
+	Wb_Tick();
+	if(ninflight == 0 || my_sd < 0){
+		return -1;
+	}
+	unsigned long before = ncompleted;
+	long end = timeout_ms < 0 ? -1 : now_us() + timeout_ms * 1000L;
+	char *in = (char*) malloc(sizeof(message_t));
+	message_t *receive = (message_t*) malloc(sizeof(message_t));
+	struct timeval tv;
+	fd_set set;
+	long wait = 0;
+	while(1){
+		// everything that has already arrived
+		FD_ZERO(&set);
+		FD_SET(my_sd,&set);
+		tv.tv_sec = wait / 1000000;
+		tv.tv_usec = wait % 1000000;
+		while(select(my_sd+1, &set, NULL, NULL, &tv) > 0){
+			unsigned int id;
+			int direct = Recv_Reply(in, receive, &id);
+			if(direct >= 0)
+				Async_Reply(id, in, receive, direct);
+			if(my_sd < 0)
+				break;
+			FD_ZERO(&set);
+			FD_SET(my_sd,&set);
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+		}
+
+		// resend what is overdue, and find the next deadline
+		long now = now_us();
+		long next = -1;
+		for(int i = 0; i < MAX_INFLIGHT && ninflight > 0; i++){
+			inflight_t *f = &inflight[i];
+			if(!f->used)
+				continue;
+			if(my_sd < 0){
+				// the connection broke, and took every request with it
+				Complete(i, -1);
+				continue;
+			}
+			if(my_tcp){
+				// a TCP connection does its own retransmission (see Exchange)
+				long due = f->sent + TCP_WAIT;
+				if(due <= now)
+					Tcp_Reconnect();
+				else if(next < 0 || due < next)
+					next = due;
+				continue;
+			}
+			long due = f->sent + (rto << f->tries > RTO_MAX ? RTO_MAX : rto << f->tries);
+			if(due <= now){
+				if(f->tries == MAX_RETRIES){
+					Complete(i, -1);
+					continue;
+				}
+				f->tries++;
+				f->sent = now;
+				Async_Send(f);
+				due = now + (rto << f->tries > RTO_MAX ? RTO_MAX : rto << f->tries);
+			}
+			if(next < 0 || due < next)
+				next = due;
+		}
+
+		if(ncompleted > before || ninflight == 0 || my_sd < 0 || (end >= 0 && now >= end))
+			break;
+		if(end >= 0 && (next < 0 || end < next))
+			next = end;
+		wait = next - now;
+	}
+	free(in);
+	free(receive);
+	return (int) (ncompleted - before);
+}
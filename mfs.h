@@ -27,4 +27,67 @@ int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
 int MFS_Shutdown();
 
+// Resolves a slash-separated path from pinum, or from the root if it starts
+// with '/', in one request. If st is not NULL it gets the stat of each of
+// the first max components. Returns the final inum, or -1.
+int MFS_Lookup_Path(int pinum, char *path, MFS_Stat_t *st, int max);
+
+// Compound requests: up to 64 operations sent in one datagram and run by the
+// server in order, stopping at the first that fails. An operation with
+// ref >= 0 acts on the inode produced by operation ref of the same batch
+// (the one looked up or created, or else the one it acted on) instead of
+// inum. Names, write data and read data must fit in one block altogether.
+// (numbered as the protocol's own operations)
+enum { MFS_OP_LOOKUP = 1, MFS_OP_STAT, MFS_OP_WRITE, MFS_OP_READ, MFS_OP_CREAT, MFS_OP_UNLINK };
+
+typedef struct __MFS_Op_t {
+    int op;         // MFS_OP_*
+    int inum;       // inode, or parent directory for lookup, creat and unlink
+    int ref;        // -1, or an earlier operation standing in for inum
+    char *name;     // lookup, creat, unlink
+    int type;       // creat
+    char *buf;      // read, write
+    int offset;
+    int nbytes;
+    int rc;         // set: what the single call returns, -1 if not run
+    int result;     // set: inode produced
+    MFS_Stat_t st;  // set by stat
+} MFS_Op_t;
+
+int MFS_Compound(MFS_Op_t *ops, int n); // 0 if every operation succeeded, else -1
+
+// Where a directory listing resumes; zero it to start from the beginning.
+typedef struct __MFS_Cookie_t {
+    int pos;        // -1 once the listing is complete
+    char name[28];
+} MFS_Cookie_t;
+
+// Lists up to max live entries of directory inum from *cookie on into ents
+// and, if st is not NULL, each entry's stat into st (type -1 for an entry
+// removed meanwhile), then advances the cookie. Returns the number listed,
+// 0 once the listing is complete, or -1.
+int MFS_Readdir(int inum, MFS_Cookie_t *cookie, MFS_DirEnt_t *ents, MFS_Stat_t *st, int max);
+
+// Write-back mode (off by default): MFS_Write only buffers, merging writes to
+// the same file, and returns 0. Buffers are sent when large or a moment old,
+// before reads, stats and unlinks, and by MFS_Fsync and MFS_Shutdown; errors
+// show up in the next MFS_Fsync.
+int MFS_WriteBack(int on);
+int MFS_Fsync(int inum); // inum -1: every file
+
+// Asynchronous calls: each sends its request and returns an id (>= 0) at
+// once, or -1. Many can be in flight; MFS_Poll matches their replies in any
+// order and calls done(id, result, arg), result being what the synchronous
+// call returns. Buffers and stat structs must stay valid until then; a
+// write's data is sent (and resent) from its buffer, which must not change.
+typedef void (*MFS_Done_t)(int id, int result, void *arg);
+
+int MFS_Lookup_Async(int pinum, char *name, MFS_Done_t done, void *arg);
+int MFS_Stat_Async(int inum, MFS_Stat_t *m, MFS_Done_t done, void *arg);
+int MFS_Write_Async(int inum, char *buffer, int offset, int nbytes, MFS_Done_t done, void *arg);
+int MFS_Read_Async(int inum, char *buffer, int offset, int nbytes, MFS_Done_t done, void *arg);
+int MFS_Creat_Async(int pinum, int type, char *name, MFS_Done_t done, void *arg);
+int MFS_Unlink_Async(int pinum, char *name, MFS_Done_t done, void *arg);
+int MFS_Poll(int timeout_ms);
+
 #endif // __MFS_h__
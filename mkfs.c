@@ -6,9 +6,10 @@
 #include <unistd.h>
 
 #include "ufs.h"
+#include "message.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-j <journal_blocks>] [-l]\n");
     exit(1);
 }
 
@@ -17,9 +18,11 @@ int main(int argc, char *argv[]) {
     char *image_file = NULL;
     int num_inodes = 32;
     int num_data = 32;
+    int num_journal = 0;
+    int log_structured = 0;
     int visual = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:j:lv")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -30,6 +33,12 @@ int main(int argc, char *argv[]) {
 	case 'f':
 	    image_file = optarg;
 	    break;
+	case 'j':
+	    num_journal = atoi(optarg);
+	    break;
+	case 'l':
+	    log_structured = 1;
+	    break;
 	case 'v':
 	    visual = 1;
 	    break;
@@ -58,6 +67,8 @@ int main(int argc, char *argv[]) {
 
     assert(num_inodes >= 32);
     assert(num_data >= 32);
+    assert(num_journal == 0 || num_journal >= 64);  // a transaction must hold a whole request
+    assert(!log_structured || (num_journal == 0 && num_inodes <= LFS_MAX_INODES));
 
     // presumed: block 0 is the super block
     super_t s;
@@ -91,7 +102,15 @@ int main(int argc, char *argv[]) {
     s.data_region_addr = s.inode_region_addr + s.inode_region_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    // metadata journal
+    s.journal_addr = s.data_region_addr + s.data_region_len;
+    s.journal_len = num_journal;
+
+    // log checkpoint
+    s.log_checkpoint = log_structured ? s.journal_addr + s.journal_len : 0;
+
+    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len
+	+ s.journal_len + log_structured;
 
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
@@ -106,6 +125,10 @@ int main(int argc, char *argv[]) {
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    if (num_journal > 0)
+	printf("  journal address/len      %d [%d]\n", s.journal_addr, s.journal_len);
+    if (log_structured)
+	printf("  log checkpoint address   %d\n", s.log_checkpoint);
 
     // first, zero out all the blocks
     int i;
@@ -180,6 +203,32 @@ int main(int argc, char *argv[]) {
     rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
     assert(rc == UFS_BLOCK_SIZE);
 
+    //
+    // empty journal: replay would start at its first log block
+    //
+    if (num_journal > 0) {
+	jsuper_t js;
+	js.magic = JNL_MAGIC;
+	js.seq = 1;
+	js.start = 1;
+	rc = pwrite(fd, &js, sizeof(jsuper_t), s.journal_addr * UFS_BLOCK_SIZE);
+	assert(rc == sizeof(jsuper_t));
+    }
+
+    //
+    // empty inode map: every inode is still at its inode table slot,
+    // and the log continues after the root directory block
+    //
+    if (log_structured) {
+	track_t ck;
+	ck.tfinal = s.data_region_addr + 1;
+	for (i = 0; i < 256; i++)
+	    ck.node_array[i] = -1;
+	ck.inode_count = 1;
+	rc = pwrite(fd, &ck, sizeof(track_t), s.log_checkpoint * UFS_BLOCK_SIZE);
+	assert(rc == sizeof(track_t));
+    }
+
     if (visual) {
 	int i;
 	printf("\nVisualization of layout\n\n");
@@ -192,6 +241,10 @@ int main(int argc, char *argv[]) {
 	    printf("I");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
+	for (i = 0; i < s.journal_len; i++)
+	    printf("J");
+	if (log_structured)
+	    printf("C");
 	printf("\n\n");
     }
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,23 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
 
 #include "mfs.h"
 #include "udp.h"
@@ -17,502 +35,3689 @@
 
 int fd = -1;
 super_t super;
-unsigned int highest_inode = 0;
-unsigned int hghst_alloc_dblk = 0;
+
+/* allocator state for one on-disk bitmap */
+typedef struct bmalloc_t {
+  unsigned int *bits;  // resident bitmap words, number 0 is the MSB of word 0
+  int nbits;           // number of valid bits
+  int hint;            // word to start the next free-bit search at
+  int nfree;           // bits currently clear
+  int threaded;        // 1: frees never move the hint back, so allocation
+                       // walks the bitmap like a log tail
+} bmalloc_t;
+
+bmalloc_t ialloc;      // inode bitmap
+bmalloc_t dalloc;      // data bitmap, bit k is block data_region_addr + k
+
+/* a directory entry in the in-memory name index */
+typedef struct dent_t {
+  int pinum;              // directory holding the entry
+  int inum;               // inode the name refers to
+  unsigned int hash;      // dhash(pinum, name)
+  unsigned int addr;      // byte address of the dir_ent_t in the image
+  char name[28];
+  struct dent_t *next;    // next entry in the same hash bucket
+  struct dent_t *dnext;   // next entry of the same directory
+} dent_t;
+
+/* name index over directories, rebuilt lazily from disk after a restart */
+dent_t **dindex = NULL;       // hash buckets
+unsigned int dindex_mask = 0;
+unsigned int dindex_count = 0;
+dent_t **dlist = NULL;        // per inode: entries of that directory
+unsigned char *dindexed = NULL; // per inode: 1 once its entries are in the index
+
+#define is_dir(type) ((type) == UFS_DIRECTORY || (type) == UFS_DIR_BTREE)
+
+/* directories growing past this many blocks are converted to B-trees */
+int btree_threshold = 8;
+
+/* block cache tunables (see usage) */
+int bc_nframes = 1024;   // number of 4 KiB frames in the cache
+int flush_secs = 5;      // write-back interval in seconds, 0 = after every request
+
+/* a cached image block */
+typedef struct bframe_t {
+  int blk;                 // block number held, -1 if the frame is free
+  int dirty;               // modified since it was read from the image
+  int ref;                 // CLOCK reference bit
+  int pin;                 // users between blkget and blkput; pinned frames are not evicted
+  int busy;                // being read from the image, wait on bc_cond
+  struct bframe_t *hnext;  // next frame in the same hash bucket
+  char data[UFS_BLOCK_SIZE];
+} bframe_t;
+
+bframe_t *bc_frames = NULL;
+bframe_t **bc_hash = NULL;
+unsigned int bc_hmask = 0;
+int bc_hand = 0;
+unsigned long bc_hits = 0, bc_misses = 0, bc_evictions = 0, bc_writebacks = 0;
+time_t last_flush = 0;
+volatile sig_atomic_t report_stats = 0;
+
+/*
+request threads (see usage); with more than one, requests run concurrently
+under the locks below, always taken in this order:
+fs_lock, inode locks (by stripe), dindex_lock, alloc_lock, bc_lock, meta_lock
+*/
+int nthreads = 1;
+pthread_rwlock_t fs_lock;         // shared by requests, exclusive for flushes
+#define ILOCKS (256)
+pthread_rwlock_t ilocks[ILOCKS];  // per inode, striped by inum
+pthread_mutex_t dindex_lock = PTHREAD_MUTEX_INITIALIZER;  // name index
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;   // bitmaps and log bookkeeping
+pthread_mutex_t bc_lock = PTHREAD_MUTEX_INITIALIZER;      // cache frames, hash and counters
+pthread_cond_t bc_cond = PTHREAD_COND_INITIALIZER;        // a frame was loaded or unpinned
+pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;    // meta_dirty
+pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;   // the single submission ring
+
+/* SO_REUSEPORT sharding: one socket and epoll loop per shard thread */
+typedef struct shard_t {
+  int id;
+  int sd;                  // this shard's socket, bound to the server port
+  int ep;                  // epoll instance watching sd
+  unsigned long requests;  // datagrams handled
+} shard_t;
+int nshards = -1;          // -s; -1 = one socket
+shard_t *shards = NULL;
+
+/* TCP transport (-T): a thread per connection, datagrams framed as in message.h */
+#define TCP_SEND_SECS (10)       // a client that takes no data for this long is dropped
+int use_tcp = 0;
+unsigned char *tcp_fd = NULL;    // by descriptor: is it a TCP connection
+int tcp_nfd = 0;
+unsigned long tcp_conns = 0, tcp_requests = 0;
+unsigned long tcp_deferred = 0;  // reads whose frame was finished after the locks were dropped
+
+/* batched datagram I/O: up to batch_max requests per recvmmsg */
+int batch_max = 32;
+#define BATCH_BUCKETS (8)
+unsigned long batch_hist[BATCH_BUCKETS];  // receives by batch size: 1, 2-3, 4-7, ... 128+
+unsigned long batch_msgs = 0;             // datagrams received in batches
+
+/* group commit across request threads */
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+unsigned long op_seq = 0;       // mutating requests finished so far
+unsigned long durable_seq = 0;  // of those, how many a commit covers
+int committing = 0;
+
+/* mmap mode: the whole image is mapped and the cache is bypassed */
+int use_mmap = 0;
+char *image = NULL;
+size_t image_len = 0;
+
+/* one whole-block transfer between the image and memory */
+typedef struct bio_t {
+  int blk;
+  char *data;
+} bio_t;
+
+/* storage backend used by the cache to move blocks in batches */
+typedef struct backend_t {
+  char *name;
+  int (*read)(bio_t *v, int n);
+  int (*write)(bio_t *v, int n);
+} backend_t;
+
+int pio_read(bio_t *v, int n);
+int pio_write(bio_t *v, int n);
+int uring_read(bio_t *v, int n);
+int uring_write(bio_t *v, int n);
+
+backend_t pio_backend = { "pread/pwrite", pio_read, pio_write };
+backend_t uring_backend = { "io_uring", uring_read, uring_write };
+backend_t *backend = &pio_backend;
+int use_uring = 0;
+
+/* resident metadata: inode bitmap, data bitmap and inode table, loaded once */
+char *meta = NULL;
+int meta_start = 0, meta_len = 0;  // block range covered, in blocks
+unsigned char *meta_dirty = NULL;  // one flag per metadata block
+unsigned int *ibitmap = NULL;
+unsigned int *dbitmap = NULL;
+inode_t *itable = NULL;
+unsigned long meta_flushed = 0;
+int ndirty = 0;                    // metadata blocks and cache frames awaiting a flush
+
+/* with a journal or log, requests are admitted against a budget of dirty blocks
+   (see dirty_reserve); reserve_lock is taken before fs_lock */
+int dirty_cap = 0;                 // most blocks dirty between flushes, 0 = no limit
+int dirty_reserved = 0;            // blocks promised to admitted requests still running
+pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reserve_cond = PTHREAD_COND_INITIALIZER;   // a reservation was returned
+
+/* metadata journal, active when mkfs reserved a journal region */
+int jnl_active = 0;
+int jnl_head = 1;      // next free journal block, relative to journal_addr
+int jnl_seq = 1;       // sequence number of the next transaction
+int jnl_limit = 0;     // commit once this many blocks are dirty
+unsigned long jnl_commits = 0, jnl_logged = 0;
+
+/* log-structured mode, active when mkfs reserved a log checkpoint */
+int lfs_active = 0;
+track_t lfs_ckpt;               // checkpoint: locations of the imap pieces
+N_Trace *lfs_imap = NULL;       // imap: location of every inode, -1 = inode table slot
+int lfs_gblk[4];                // block holding each group of 64 imap pieces, -1 = none
+int *lfs_iblk = NULL;           // per inode table block: log block holding it, -1 = none
+int *downer = NULL;             // per data block: inode whose direct[] points at it, -1 = none
+unsigned char *dfresh = NULL;   // per data block: allocated since the last checkpoint
+int *lfs_dead = NULL;           // blocks to free once the next checkpoint is durable
+int lfs_ndead = 0, lfs_deadcap = 0;
+int lfs_tail = 0;               // block after the last one appended
+int lfs_hold = 0;               // data blocks kept free for the next checkpoint's own blocks
+unsigned long lfs_checkpoints = 0, lfs_appended = 0, lfs_relocated = 0;
+
+/* replies held back until the journal commit that makes their operation durable */
+#define GROUP_MAX (64)
+typedef struct held_t {
+  struct sockaddr_in addr;
+  int len;                        // datagram length: compact, or a whole message_t
+  char data[sizeof(message_t)];   // the encoded reply
+} held_t;
+held_t held[GROUP_MAX];
+int nheld = 0;
+
+/* ranged writes whose fragments are still arriving; frag_lock is taken on its own */
+#define FRAG_SECS (10)
+typedef struct frag_t {
+  struct sockaddr_in addr;  // sender and request id identify the write
+  unsigned int reqid;
+  int inum, start, len;
+  int nfrags, got;          // fragments expected and received
+  unsigned char have[WIRE_WINDOW];
+  time_t born;
+  char *data;
+  struct frag_t *next;
+} frag_t;
+frag_t *frags = NULL;
+pthread_mutex_t frag_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long range_reads = 0, range_writes = 0;
+unsigned long compounds = 0, compound_ops = 0;
+unsigned long dir_lists = 0, dir_listed = 0;
+unsigned long zc_pinned = 0, zc_bounced = 0; // blocks sent from memory, read from disk to send
+unsigned long zc_spliced = 0;                // blocks sent from the image with sendfile
+
+/*
+duplicate request cache: the replies to recent mutating requests, by sender
+and request id, so a retransmission is answered without running it again;
+drc_lock is taken on its own
+*/
+#define DRC_SIZE (4096)   // entries, a power of two; the oldest is reused first
+enum { DRC_NEW, DRC_BUSY, DRC_DONE };
+typedef struct drc_t {
+  struct sockaddr_in addr;
+  unsigned int reqid;
+  int state;                      // DRC_BUSY while running, then DRC_DONE
+  int len;
+  char *rep;                      // the reply, len bytes on the heap (a compound's
+                                  // carries its results); kept when the entry is reused
+  int hnext;                      // next entry in the hash chain, -1 ends it
+} drc_t;
+drc_t *drc = NULL;
+int *drc_hash = NULL;
+int drc_clock = 0;                // next entry to reuse
+pthread_mutex_t drc_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long drc_replayed = 0, drc_dropped = 0;
+
+/*
+invalidation log: the inodes each mutation changed, numbered by inval_seq,
+piggybacked on lookup and stat replies so clients can drop what they cached
+under a lease; inval_lock is taken on its own
+*/
+#define INVAL_LOG (1024)
+int inval_log[INVAL_LOG];
+unsigned int inval_seq = 0;       // number of the last entry, seeded from the clock
+pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+int lease_ms = 1000;              // -L: how long clients may cache lookups and stats
+
+/* sockets get room for a whole window of fragments from several clients */
+#define SOCK_BUF (1 << 20)
+
+#define URING_ENTRIES (64)
+
+/* io_uring submission and completion rings, mapped from the kernel */
+struct {
+  int ring_fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned entries;
+} uring = { -1 };
 
 // set up the needed functions
 int read_inode(unsigned int, inode_t *);
 dir_ent_t* lookup_file(int, char*, unsigned int*);
 int write_file(int inum, void *buf, unsigned int offset, int nbytes, int type);
 int alloc_dblk(void);
+int dblk_take(int keep);
+void zero_dblk(int blk);
+int bm_alloc(bmalloc_t *b);
+unsigned int mask(unsigned int num);
+unsigned int *bmword(unsigned int *bitmap, unsigned int num);
+void bm_free(bmalloc_t *b, int num);
 int fsread(int addr, void *ptr, size_t nbytes);
 int fswrite(unsigned int addr, void *ptr, size_t nbytes);
 int new_inode(int);
+void free_inode(int);
+void free_dblk(int);
 
 int initialize_serv(char* );
 int run_udp(int);
 int end_serv();
 
-int fsread(int addr, void *ptr, size_t nbytes) {
-  lseek(fd, addr, SEEK_SET);
-  return read(fd, ptr, nbytes);
+/* pio backend: one pread/pwrite per block */
+int pio_read(bio_t *v, int n) {
+  for (int i = 0; i < n; i++) {
+    ssize_t rc = pread(fd, v[i].data, UFS_BLOCK_SIZE, (off_t) v[i].blk * UFS_BLOCK_SIZE);
+    if (rc < 0) {
+      perror("pio_read");
+      return -1;
+    }
+    if (rc < UFS_BLOCK_SIZE) memset(v[i].data + rc, 0, UFS_BLOCK_SIZE - rc);
+  }
+  return 0;
 }
 
-int fswrite(unsigned int addr, void *ptr, size_t nbytes) {
-  debug("In fswrite: writing at addr %u.%d bytes %lu\n", 
-    addr / UFS_BLOCK_SIZE, addr % UFS_BLOCK_SIZE, nbytes);
-  lseek(fd, addr, SEEK_SET);
-  int rc = write(fd, ptr, nbytes);
-  return rc;
+int pio_write(bio_t *v, int n) {
+  for (int i = 0; i < n; i++) {
+    if (pwrite(fd, v[i].data, UFS_BLOCK_SIZE, (off_t) v[i].blk * UFS_BLOCK_SIZE) 
+        != UFS_BLOCK_SIZE) {
+      perror("pio_write");
+      return -1;
+    }
+  }
+  return 0;
 }
 
-void inode_dbg(int inum) {
-  inode_t * ind = (inode_t *) malloc(sizeof(inode_t));
-  read_inode(inum, ind);
-  if (ind == NULL) return;
-  debug("inum %d type: %d size: %d ", inum, ind->type, ind->size);
-  debug("direct: ");
-  for(int i = 0; i < DIRECT_PTRS; i++) {
-    debug("%d ", ind->direct[i]);
+/*
+uring_init: set up an io_uring instance and map its rings
+returns: 0 on success, -1 if io_uring is unavailable
+*/
+int uring_init() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int rfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (rfd < 0) return -1;
+
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+    rfd, IORING_OFF_SQ_RING);
+  char *cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+    rfd, IORING_OFF_CQ_RING);
+  void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), 
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(rfd);
+    return -1;
   }
-  debug("\n");
-}
 
-void dir_dbg(int inum) {
-  debug("inum %d dir entries: ", inum);
-  inode_t *ind = (inode_t *) malloc(sizeof(inode_t));
-  read_inode(inum, ind);
-  if (ind == NULL) return;
-  for(int i = 0; i < (ind->size / sizeof(dir_ent_t)); i++) {
-    dir_ent_t de;
-    fsread(ind->direct[0] * UFS_BLOCK_SIZE + i * sizeof(dir_ent_t), 
-      &de, sizeof(dir_ent_t)); 
-    debug("%s %d, ", de.name, de.inum);
+  uring.ring_fd = rfd;
+  uring.entries = p.sq_entries;
+  uring.sq_head = (unsigned *) (sq + p.sq_off.head);
+  uring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  uring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  uring.sq_array = (unsigned *) (sq + p.sq_off.array);
+  uring.cq_head = (unsigned *) (cq + p.cq_off.head);
+  uring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  uring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  uring.sqes = (struct io_uring_sqe *) sqes;
+
+  /* probe with a real read so kernels without IORING_OP_READ fall back too */
+  char probe[UFS_BLOCK_SIZE];
+  bio_t b = { 0, probe };
+  if (uring_read(&b, 1) < 0) {
+    close(rfd);
+    uring.ring_fd = -1;
+    return -1;
   }
-  debug("\n");
+  return 0;
 }
 
-/* a 32-bit mask for a number starting from leftmost bit*/
-unsigned int mask(unsigned int num) {
-  return 0x1 << (8 * sizeof(unsigned int) - (num % (8 * sizeof(unsigned int))) - 1);
+/*
+uring_rw: queue one SQE per block, submit them with a single io_uring_enter
+and reap the completions. Batches larger than the ring go in ring-sized chunks.
+*/
+int uring_rw(bio_t *v, int n, int op) {
+  int rc = 0;
+  while (n > 0) {
+    int batch = n < uring.entries ? n : uring.entries;
+    unsigned tail = *uring.sq_tail;
+    for (int i = 0; i < batch; i++) {
+      unsigned idx = tail & *uring.sq_mask;
+      struct io_uring_sqe *sqe = &uring.sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = op;
+      sqe->fd = fd;
+      sqe->addr = (unsigned long) v[i].data;
+      sqe->len = UFS_BLOCK_SIZE;
+      sqe->off = (unsigned long long) v[i].blk * UFS_BLOCK_SIZE;
+      sqe->user_data = i;
+      uring.sq_array[idx] = idx;
+      tail++;
+    }
+    __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    while (submitted < batch) {
+      int r = syscall(__NR_io_uring_enter, uring.ring_fd, batch - submitted, 
+        batch - submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        perror("uring_rw: io_uring_enter");
+        return -1;
+      }
+      submitted += r;
+    }
+
+    int reaped = 0;
+    while (reaped < batch) {
+      unsigned head = *uring.cq_head;
+      if (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        syscall(__NR_io_uring_enter, uring.ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        continue;
+      }
+      struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+      bio_t *b = &v[cqe->user_data];
+      if (cqe->res < 0) {
+        debug("In uring_rw: block %d failed: %s\n", b->blk, strerror(-cqe->res));
+        rc = -1;
+      } else if (op == IORING_OP_READ && cqe->res < UFS_BLOCK_SIZE) {
+        memset(b->data + cqe->res, 0, UFS_BLOCK_SIZE - cqe->res);
+      } else if (op == IORING_OP_WRITE && cqe->res < UFS_BLOCK_SIZE) {
+        rc = -1;
+      }
+      __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+      reaped++;
+    }
+    v += batch;
+    n -= batch;
+  }
+  return rc;
 }
 
-unsigned int bmaddr(unsigned int start, unsigned int inum) {
-  return start * UFS_BLOCK_SIZE 
-    + floor(inum / (8 * sizeof(unsigned int))) * sizeof(unsigned int);  
+int uring_read(bio_t *v, int n) {
+  pthread_mutex_lock(&uring_lock);
+  int rc = uring_rw(v, n, IORING_OP_READ);
+  pthread_mutex_unlock(&uring_lock);
+  return rc;
 }
 
-int read_inode(unsigned int inum, inode_t * ind) {
-  unsigned int ibm; 
-  fsread(bmaddr(super.inode_bitmap_addr, inum), 
-    &ibm, sizeof(unsigned int));
-  int valid = ibm && mask(inum);
-  if (!valid) {
-    ind = NULL;
-    return -1;
-  };
+int uring_write(bio_t *v, int n) {
+  pthread_mutex_lock(&uring_lock);
+  int rc = uring_rw(v, n, IORING_OP_WRITE);
+  pthread_mutex_unlock(&uring_lock);
+  return rc;
+}
 
-  fsread(super.inode_region_addr * UFS_BLOCK_SIZE + inum * sizeof(inode_t), 
-    ind, sizeof(inode_t));
-  return 0;
+/* disk_read / disk_write: move one whole block between the image and memory */
+int disk_read(int blk, char *data) {
+  bio_t b = { blk, data };
+  return backend->read(&b, 1);
 }
 
-void write_inode(int inum, inode_t *inode) {
-  fswrite(super.inode_region_addr * UFS_BLOCK_SIZE + inum * sizeof(inode_t),
-    inode, sizeof(inode_t));
+int disk_write(int blk, char *data) {
+  debug("In disk_write: writing block %d\n", blk);
+  bio_t b = { blk, data };
+  return backend->write(&b, 1);
 }
 
 /*
-lookup_file: Find a file in a parent directory
-params: parent-inum, file-name, 
-returns: dir_ent and addr if found, 
-    NULL if par inode not found, par inode not dir or file not found
-
-Iterates over directory entries in data block of parent to find a file. 
+bc_init: allocate the frame pool and a power-of-two hash table over it
 */
-dir_ent_t* lookup_file(int pinum, char* name, unsigned int *addr){
-  debug("In lookup_file: pinum %d name %s. entering ...\n", pinum, name);
-  inode_t *nd = (inode_t *) malloc(sizeof(inode_t));
-  read_inode(pinum, nd);
-  
-  if(nd == NULL || nd->type != UFS_DIRECTORY) return NULL;
-    
-  unsigned int mxb = ceil(1.0 * nd->size / UFS_BLOCK_SIZE); 
+int bc_init(int nframes) {
+  if (nframes < 8) nframes = 8;
+  bc_nframes = nframes;
+  bc_frames = (bframe_t *) calloc(nframes, sizeof(bframe_t));
+  unsigned int hsize = 1;
+  while (hsize < 2 * nframes) hsize <<= 1;
+  bc_hash = (bframe_t **) calloc(hsize, sizeof(bframe_t *));
+  if (bc_frames == NULL || bc_hash == NULL) {
+    perror("bc_init: out of memory");
+    return -1;
+  }
+  bc_hmask = hsize - 1;
+  for (int i = 0; i < nframes; i++)
+    bc_frames[i].blk = -1;
+  return 0;
+}
 
-  for (int i = 0; i < mxb; i++) {
-    debug("In lookup_file: reading direct block %d (addr %d)\n", i, nd->direct[i]);
+bframe_t *bc_lookup(int blk) {
+  bframe_t *f = bc_hash[blk & bc_hmask];
+  while (f != NULL && f->blk != blk) f = f->hnext;
+  return f;
+}
 
-    dir_ent_t * de = (dir_ent_t *) malloc(sizeof(dir_ent_t));
-    for (int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
-      unsigned int deaddr = nd->direct[i] * UFS_BLOCK_SIZE + j * sizeof(dir_ent_t);
-      fsread(deaddr, de, sizeof(dir_ent_t));
-      if(strcmp(de->name, name) == 0 && de->inum != -1) {
-        debug("In lookup_file: file found. inum %d addr %u. returning ...\n", de->inum, deaddr);
-        *addr = deaddr;
-        return de;
-      }
+void bc_unhash(bframe_t *f) {
+  bframe_t **pp = &bc_hash[f->blk & bc_hmask];
+  while (*pp != f) pp = &(*pp)->hnext;
+  *pp = f->hnext;
+  f->hnext = NULL;
+}
+
+/*
+bc_victim: pick a frame to reuse with the CLOCK algorithm
+Dirty victims are written back before the frame is handed out, except with
+a journal or log, where dirty frames are never victims (dirty_reserve keeps
+enough of the pool clean). Called with bc_lock held; waits for an unpin if
+every frame is in use.
+*/
+bframe_t *bc_victim() {
+  for (int scanned = 0; ; scanned++) {
+    if (scanned == 4 * bc_nframes) {
+      pthread_cond_wait(&bc_cond, &bc_lock);
+      scanned = 0;
+    }
+    bframe_t *f = &bc_frames[bc_hand];
+    bc_hand = (bc_hand + 1) % bc_nframes;
+    if (f->pin > 0) continue;
+    if (f->blk == -1) return f;
+    if (f->ref) {
+      f->ref = 0;
+      continue;
+    }
+    /* with a journal, uncommitted blocks may not reach their home location;
+       in log mode, dirty blocks wait for the flush that appends them */
+    if (f->dirty && (jnl_active || lfs_active)) continue;
+    if (f->dirty) {
+      disk_write(f->blk, f->data);
+      f->dirty = 0;
+      __sync_fetch_and_sub(&ndirty, 1);
+      bc_writebacks++;
     }
+    bc_unhash(f);
+    f->blk = -1;
+    bc_evictions++;
+    return f;
   }
-  debug("In lookup_file: file not found. returning NULL\n");
-  return NULL;
 }
 
 /*
-creat_file: Create a new regular file or directory in a parent dir
-params: parent inum, new-file type, new-file name
-return: 0 on success, -1 on failure
+bc_get: return the frame caching block blk, pinned
+If fill is 0 the caller overwrites the whole block, so a miss skips the read.
+Called with bc_lock held; the lock is dropped while a miss is read, and other
+threads asking for the same block wait for that read.
 */
-int creat_file(int pinum, int type, char *name) {
-  debug("In creat_file: to create file %s. entering ...\n", name);
-  /* Check if par is dir*/
-  inode_t *pnd = (inode_t *) malloc(sizeof(inode_t));
-  read_inode(pinum, pnd);
-  if(pnd == NULL || pnd ->type != UFS_DIRECTORY) return -1;
-
-  /* Check if name already exists */
-  unsigned int addr;
-  dir_ent_t* lde = lookup_file(pinum, name, &addr);
-  if (lde != NULL) return 0;
-
-  int ninum = new_inode(type);
-  if (ninum == -1) return -1;
+bframe_t *bc_get(int blk, int fill) {
+  bframe_t *f;
+  while ((f = bc_lookup(blk)) != NULL && f->busy)
+    pthread_cond_wait(&bc_cond, &bc_lock);
+  if (f != NULL) {
+    bc_hits++;
+    f->ref = 1;
+    f->pin++;
+    return f;
+  }
+  bc_misses++;
+  f = bc_victim();
+  f->blk = blk;
+  f->ref = 1;
+  f->pin = 1;
+  f->hnext = bc_hash[blk & bc_hmask];
+  bc_hash[blk & bc_hmask] = f;
+  if (fill) {
+    f->busy = 1;
+    pthread_mutex_unlock(&bc_lock);
+    disk_read(blk, f->data);
+    pthread_mutex_lock(&bc_lock);
+    f->busy = 0;
+    pthread_cond_broadcast(&bc_cond);
+  }
+  return f;
+}
 
-  /* if new dir, add . and .. */
-  if (type == UFS_DIRECTORY) {
-    inode_t *nnd = (inode_t *) malloc(sizeof(inode_t));
-    read_inode(ninum, nnd);
+/* bc_discard: forget a cached block that no longer holds live data */
+void bc_discard(int blk) {
+  if (bc_frames == NULL) return;
+  pthread_mutex_lock(&bc_lock);
+  bframe_t *f = bc_lookup(blk);
+  if (f != NULL && f->pin == 0) {
+    if (f->dirty) __sync_fetch_and_sub(&ndirty, 1);
+    bc_unhash(f);
+    f->blk = -1;
+    f->dirty = 0;
+  }
+  pthread_mutex_unlock(&bc_lock);
+}
 
-    int ndb = alloc_dblk();
-    if (ndb == -1) return -1;
-    nnd->direct[0] = ndb;
-    
-    dir_block_t db;
-    strcpy(db.entries[0].name, "."); 
-    db.entries[0].inum = ninum;
-    strcpy(db.entries[1].name, "..");
-    db.entries[1].inum = pinum; 
-    for (int i = 2; i < UFS_BLOCK_SIZE / sizeof(dir_ent_t); i++)
-      db.entries[i].inum = -1;
-    fswrite(ndb * UFS_BLOCK_SIZE, &db, sizeof(dir_block_t));
-    nnd->size = 2 * sizeof(dir_ent_t);
-    write_inode(ninum, nnd);
+void bc_report(FILE *out) {
+  unsigned long total = bc_hits + bc_misses;
+  fprintf(out, "block cache (%s): %d frames, %lu hits, %lu misses (%.1f%% hit), "
+    "%lu evictions, %lu writebacks\n", backend->name, bc_nframes, bc_hits, bc_misses,
+    total ? 100.0 * bc_hits / total : 0.0, bc_evictions, bc_writebacks);
+  fprintf(out, "metadata: %d blocks resident, %lu block flushes\n", meta_len, meta_flushed);
+  if (jnl_active)
+    fprintf(out, "journal: %lu commits, %lu blocks logged (%.1f per commit)\n", jnl_commits, 
+      jnl_logged, jnl_commits ? 1.0 * jnl_logged / jnl_commits : 0.0);
+  unsigned long nbatch = 0;
+  for (int i = 0; i < BATCH_BUCKETS; i++) nbatch += batch_hist[i];
+  if (nbatch > 0) {
+    fprintf(out, "batches: %lu receives, %.1f requests each, sizes", nbatch, 1.0 * batch_msgs / nbatch);
+    for (int i = 0; i < BATCH_BUCKETS; i++)
+      if (i == 0) fprintf(out, " 1:%lu", batch_hist[0]);
+      else fprintf(out, " %d-%d:%lu", 1 << i, (2 << i) - 1, batch_hist[i]);
+    fprintf(out, "\n");
+  }
+  if (shards != NULL) {
+    fprintf(out, "shards: requests");
+    for (int i = 0; i < nshards; i++) fprintf(out, " %lu", shards[i].requests);
+    fprintf(out, "\n");
   }
+  if (drc_replayed + drc_dropped > 0)
+    fprintf(out, "duplicates: %lu replayed from the reply cache, %lu dropped while running\n",
+      drc_replayed, drc_dropped);
+  if (range_reads + range_writes > 0)
+    fprintf(out, "ranges: %lu reads, %lu writes\n", range_reads, range_writes);
+  if (compounds > 0)
+    fprintf(out, "compounds: %lu, %.1f operations each\n", compounds, (double) compound_ops / compounds);
+  if (zc_pinned + zc_bounced + zc_spliced > 0) {
+    fprintf(out, "reads: %lu blocks sent from memory, %lu read from disk to send", zc_pinned, zc_bounced);
+    if (use_tcp) fprintf(out, ", %lu sent with sendfile", zc_spliced);
+    fprintf(out, "\n");
+  }
+  if (tcp_conns > 0)
+    fprintf(out, "tcp: %lu connections, %lu requests, %lu reads finished unlocked\n", tcp_conns,
+      tcp_requests, tcp_deferred);
+  if (dir_lists > 0)
+    fprintf(out, "readdir: %lu requests, %lu entries\n", dir_lists, dir_listed);
+  if (lfs_active)
+    fprintf(out, "log: %lu checkpoints, %lu blocks appended, %lu data blocks relocated\n",
+      lfs_checkpoints, lfs_appended, lfs_relocated);
+}
 
-  /* write in parent data*/
-  inode_t *pind = (inode_t *) malloc(sizeof(inode_t));
-  read_inode(pinum, pind);
-  dir_ent_t de;
-  de.inum = ninum;
-  strcpy(de.name, name);
-  write_file(pinum, &de, pind->size, sizeof(dir_ent_t), UFS_DIRECTORY);
-  debug("In creat_file: file created. returning ...\n");
-  return 0; 
+void on_sigusr1(int sig) {
+  report_stats = 1;
 }
 
 /*
-write_file
-param: inode-num, offset (0-indexed), data, nbytes
-returns: nbytes written
-
-Writes to one block or two blocks. 
-Adds a data block if not enough space in current block.
-Updates size and direct fields of a inode.
+map_image: map the whole image (layout fixed by mkfs) for mmap mode
 */
-
-int write_file(int inum, void *buf, unsigned int offset, int nbytes, int type) {
-  debug("In write_file: write inode %d at addr %u. entering ...\n", inum, offset);
-  if (type == UFS_REGULAR_FILE) {
-    buf = (char *) buf;
-  } else {
-    buf = (dir_ent_t *) buf;
+int map_image() {
+  image_len = (size_t) (super.data_region_addr + super.data_region_len) * UFS_BLOCK_SIZE;
+  struct stat fs;
+  if (fstat(fd, &fs) == 0 && fs.st_size < image_len && ftruncate(fd, image_len) < 0) {
+    perror("map_image: cannot extend image");
+    return -1;
   }
+  image = mmap(NULL, image_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED) {
+    perror("map_image: mmap failed");
+    image = NULL;
+    return -1;
+  }
+  return 0;
+}
 
-  inode_t *fnd = (inode_t *) malloc(sizeof(inode_t));
-  read_inode(inum, fnd);
-  if (fnd == NULL || fnd->type != type) return -1;
-  inode_dbg(inum);
-
-  int ofd = floor(1.0 * offset / UFS_BLOCK_SIZE);
-  if (ofd > (DIRECT_PTRS - 1)) return -1;
+/*
+meta_load: read the bitmaps and the inode table into memory in one batch
+In mmap mode the resident copy is the mapping itself.
+*/
+int meta_load() {
+  meta_start = super.inode_bitmap_addr;
+  meta_len = super.inode_region_addr + super.inode_region_len - meta_start;
+  assert(super.data_bitmap_addr >= meta_start && super.inode_region_addr >= meta_start);
 
-  unsigned int ofr = offset % UFS_BLOCK_SIZE;
-  unsigned int offree = UFS_BLOCK_SIZE - ofr;
-  int d = ofd;
-  while(d >= 0 && fnd->direct[d] == -1) {
-    unsigned int ndb = alloc_dblk();
-    if (ndb == -1) return -1;
-    debug("In write_file: adding new dblk %u to inum %d direct[%u].\n", ndb, inum, d);
-    fnd->direct[d] = ndb;
-    d--;
-  } 
-  write_inode(inum, fnd);
-  if(nbytes <= offree) {
-    fswrite(fnd->direct[ofd] * UFS_BLOCK_SIZE + ofr, buf, nbytes);
+  if (image != NULL) {
+    meta = image + (size_t) meta_start * UFS_BLOCK_SIZE;
   } else {
-    if (ofd == (DIRECT_PTRS - 1)) return -1;
-    int ndb = alloc_dblk();
-    if (ndb == -1) return -1;
-    fnd->direct[ofd + 1] = ndb;
-    fswrite(fnd->direct[ofd] * UFS_BLOCK_SIZE + ofr, buf, offree);
-    fswrite(fnd->direct[ofd + 1] * UFS_BLOCK_SIZE, 
-      buf + sizeof(char) * offree, nbytes - offree);
+    meta = (char *) malloc((size_t) meta_len * UFS_BLOCK_SIZE);
+    bio_t *v = (bio_t *) malloc(meta_len * sizeof(bio_t));
+    if (meta == NULL || v == NULL) {
+      perror("meta_load: out of memory");
+      return -1;
+    }
+    for (int i = 0; i < meta_len; i++) {
+      v[i].blk = meta_start + i;
+      v[i].data = meta + (size_t) i * UFS_BLOCK_SIZE;
+    }
+    int rc = backend->read(v, meta_len);
+    free(v);
+    if (rc < 0) return -1;
   }
-  fnd->size = (offset + nbytes) > fnd->size ? offset + nbytes: fnd->size;
-  write_inode(inum, fnd);
-  inode_dbg(inum);
-  if(type == UFS_DIRECTORY) dir_dbg(inum);
-  debug("In write_file. returning ...\n");
+  meta_dirty = (unsigned char *) calloc(meta_len, 1);
+  ibitmap = (unsigned int *) (meta + (size_t) (super.inode_bitmap_addr - meta_start) * UFS_BLOCK_SIZE);
+  dbitmap = (unsigned int *) (meta + (size_t) (super.data_bitmap_addr - meta_start) * UFS_BLOCK_SIZE);
+  itable = (inode_t *) (meta + (size_t) (super.inode_region_addr - meta_start) * UFS_BLOCK_SIZE);
+  debug("In meta_load: %d metadata blocks resident\n", meta_len);
   return 0;
 }
 
-/*
-newDataBlock function: returns block address.
-    - Find a free data block from data bitmap
-    - Set bit to 1 for this data block in data bitmap
-    - data block address = (super.data_region_addr + bit index in bitmap) * block_size
-    
-*/
-int alloc_dblk() {
-  debug("In alloc_dblk: entering ...\n");
-  /* set in d-bitmap */
-  if (hghst_alloc_dblk == (super.data_region_len - 1)) return -1;
-
-  unsigned int bits;
-  hghst_alloc_dblk += 1;
-  unsigned int dbtaddr = bmaddr(super.data_bitmap_addr, hghst_alloc_dblk);
-  fsread(dbtaddr, &bits, sizeof(unsigned int)); 
-  bits |= mask(hghst_alloc_dblk);
-  fswrite(dbtaddr, &bits, sizeof(unsigned int));
-  debug("In alloc_dblk: allocated dblk addr %d. returning ...\n", 
-    super.data_region_addr + hghst_alloc_dblk);
-  return super.data_region_addr + hghst_alloc_dblk;
+/* meta_mark: note that the resident bytes [p, p + n) were modified */
+void meta_mark(void *p, size_t n) {
+  size_t first = ((char *) p - meta) / UFS_BLOCK_SIZE;
+  size_t last = ((char *) p - meta + n - 1) / UFS_BLOCK_SIZE;
+  pthread_mutex_lock(&meta_lock);
+  for (size_t b = first; b <= last; b++) {
+    if (!meta_dirty[b]) __sync_fetch_and_add(&ndirty, 1);
+    meta_dirty[b] = 1;
+  }
+  pthread_mutex_unlock(&meta_lock);
 }
 
 /*
-read_file
-param: inode-num, buf, offset, nbytes
-returns: nbytes read
-
-Read from one block or two blocks as nbytes <= 4096.
+blkget: pointer to the in-memory copy of an image block
+Metadata blocks come from the resident copy, others from the mapping in mmap
+mode or from a cache frame that stays pinned until blkput.
+Pass dirty = 1 before modifying it, fill = 0 if the whole block is overwritten.
 */
-int read_file(int inum, char* buf, int offset, int nbytes) {
-  debug("In read_file: read inum %d at offset %u entering ...\n", inum, offset);
-  inode_t *fnd = (inode_t *) malloc(sizeof(inode_t));
-  read_inode(inum, fnd);
-  if (fnd == NULL) return -1;
-  inode_dbg(inum);
+char *blkget(int blk, int fill, int dirty) {
+  if (blk >= meta_start && blk < meta_start + meta_len) {
+    if (dirty) meta_mark(meta + (size_t) (blk - meta_start) * UFS_BLOCK_SIZE, 1);
+    return meta + (size_t) (blk - meta_start) * UFS_BLOCK_SIZE;
+  }
+  if (image != NULL) return image + (size_t) blk * UFS_BLOCK_SIZE;
+  pthread_mutex_lock(&bc_lock);
+  bframe_t *f = bc_get(blk, fill);
+  if (dirty && !f->dirty) {
+    f->dirty = 1;
+    __sync_fetch_and_add(&ndirty, 1);
+  }
+  pthread_mutex_unlock(&bc_lock);
+  return f->data;
+}
 
-  unsigned int rdb = floor(1.0 * offset / UFS_BLOCK_SIZE);
-  if (rdb > (DIRECT_PTRS - 1)) return -1;
+/* blkput: done with a block returned by blkget */
+void blkput(char *p) {
+  if (bc_frames == NULL || p < (char *) bc_frames || p >= (char *) (bc_frames + bc_nframes))
+    return;
+  bframe_t *f = (bframe_t *) (p - offsetof(bframe_t, data));
+  pthread_mutex_lock(&bc_lock);
+  if (--f->pin == 0) pthread_cond_broadcast(&bc_cond);
+  pthread_mutex_unlock(&bc_lock);
+}
 
-  unsigned int rds = offset % UFS_BLOCK_SIZE;
-  unsigned int rdf = UFS_BLOCK_SIZE - rds;
-  if (nbytes <= rdf) {
-    if(fnd->direct[rdb] == -1) return -1;
-    fsread(fnd->direct[rdb] * UFS_BLOCK_SIZE + rds, buf, nbytes);
+/* blkpin: blkget for a block already in memory, NULL if it would have to be read; never waits */
+char *blkpin(int blk) {
+  if (blk >= meta_start && blk < meta_start + meta_len)
+    return meta + (size_t) (blk - meta_start) * UFS_BLOCK_SIZE;
+  if (image != NULL) return image + (size_t) blk * UFS_BLOCK_SIZE;
+  pthread_mutex_lock(&bc_lock);
+  bframe_t *f = bc_lookup(blk);
+  if (f != NULL && !f->busy) {
+    bc_hits++;
+    f->ref = 1;
+    f->pin++;
   } else {
-    if (rdb == (DIRECT_PTRS - 1)) return -1;
-    if(fnd->direct[rdb] == -1 || fnd->direct[rdb + 1] == -1) return -1;
-    fsread(fnd->direct[rdb] * UFS_BLOCK_SIZE + rds, buf, rdf);
-    fsread(fnd->direct[rdb + 1] * UFS_BLOCK_SIZE, buf + sizeof(char) * rdf, nbytes - rdf);
+    f = NULL;
   }
-  debug("In read_file: file read. returning ...\n");
-  return 0;
+  pthread_mutex_unlock(&bc_lock);
+  return f != NULL ? f->data : NULL;
 }
 
-/*
-params: parent inum, file-name
+int bio_cmp(const void *a, const void *b) {
+  return ((bio_t *) a)->blk - ((bio_t *) b)->blk;
+}
 
-Remove a regular file or directory name from the parent dir.
+unsigned int jnl_sum(char **data, int n) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < UFS_BLOCK_SIZE; j++) {
+      h ^= (unsigned char) data[i][j];
+      h *= 16777619u;
+    }
+  return h;
+}
 
-- Get parent-inode from parent inum (call getInode)
-- Lookup file and get entry address of file (call lookupFile)
-- Cast entry to dir_ent_t and get inum.
-- Get inode from file-inum (call getInode)
-- If file type is dir and size > 0, throw err
-- Mark sizeof(dir_ent_t) bytes as invalid at entry address.
-- Return success
-*/
-int unlink_file(int pinum, char *name) {
-  debug("In unlink_file: entering ...\n");
-  unsigned int addr;
-  dir_ent_t *de = lookup_file(pinum, name, &addr);
-  if (de == NULL) return -1;
+/* jnl_checkpoint: make in-place writes durable, then restart replay at start */
+void jnl_checkpoint(int start) {
+  fsync(fd);
+  char blk[UFS_BLOCK_SIZE];
+  memset(blk, 0, sizeof(blk));
+  jsuper_t *js = (jsuper_t *) blk;
+  js->magic = JNL_MAGIC;
+  js->seq = jnl_seq;
+  js->start = start;
+  disk_write(super.journal_addr, blk);
+  fsync(fd);
+}
 
-  if (de->inum != -1) {
-    inode_t *ind = (inode_t *) malloc(sizeof(inode_t));  
-    read_inode(de->inum, ind);
-    debug("In unlink_file: to delete ");
-    inode_dbg(de->inum);
-    if (ind->type == UFS_DIRECTORY && ind->size > 2 * sizeof(dir_ent_t)) {
-      debug("In unlink_file. dir nonempty. returning ...\n");
-      return -1;
-    }
-    strcpy(de->name, "");
-    de->inum = -1;
-    fswrite(addr, de, sizeof(dir_ent_t)); 
+/*
+jnl_commit: log one transaction and make it durable with a single fsync
+The descriptor, block images and commit record go out as one backend batch.
+The caller writes the blocks in place afterwards; those writes are only
+synced when the journal wraps.
+returns: 0, -1 if the transaction failed or does not fit in the journal
+*/
+int jnl_commit(bio_t *v, int n) {
+  if (n > JNL_MAX || n + 3 > super.journal_len) {
+    fprintf(stderr, "jnl_commit: %d blocks do not fit in one transaction\n", n);
+    return -1;
   }
-
-  /* update size */
-  inode_t * pnd = (inode_t *) malloc(sizeof(inode_t));
-  read_inode(pinum, pnd);
-  int i;
-  for(i = 0; pnd->direct[i] != -1; i++) {
-    if (pnd->direct[i] = (addr / UFS_BLOCK_SIZE)) 
-      break;
+  if (jnl_head + n + 2 > super.journal_len) {
+    jnl_head = 1;
+    jnl_checkpoint(1);
   }
-  unsigned int offset = i * UFS_BLOCK_SIZE + addr % UFS_BLOCK_SIZE;
-  pnd->size = (offset < pnd->size)? offset: pnd->size;
-  write_inode(pinum, pnd);
-  debug("In unlink_file: parent ");
-  inode_dbg(pinum);
-
-  debug("In unlink_file: unlinked. returning ...\n");
+  char *desc = (char *) calloc(1, UFS_BLOCK_SIZE);
+  char *commit = (char *) calloc(1, UFS_BLOCK_SIZE);
+  char **data = (char **) malloc(n * sizeof(char *));
+  bio_t *jv = (bio_t *) malloc((n + 2) * sizeof(bio_t));
+  jdesc_t *d = (jdesc_t *) desc;
+  d->magic = JNL_DESC;
+  d->seq = jnl_seq;
+  d->nblocks = n;
+  for (int i = 0; i < n; i++) {
+    d->blocks[i] = v[i].blk;
+    data[i] = v[i].data;
+    jv[i + 1].blk = super.journal_addr + jnl_head + 1 + i;
+    jv[i + 1].data = v[i].data;
+  }
+  jcommit_t *c = (jcommit_t *) commit;
+  c->magic = JNL_COMMIT;
+  c->seq = jnl_seq;
+  c->sum = jnl_sum(data, n);
+  jv[0].blk = super.journal_addr + jnl_head;
+  jv[0].data = desc;
+  jv[n + 1].blk = super.journal_addr + jnl_head + n + 1;
+  jv[n + 1].data = commit;
+
+  int rc = backend->write(jv, n + 2);
+  if (rc == 0 && fdatasync(fd) < 0) rc = -1;
+  free(jv);
+  free(data);
+  free(commit);
+  free(desc);
+  if (rc < 0) {
+    fprintf(stderr, "jnl_commit: transaction %d failed\n", jnl_seq);
+    return -1;
+  }
+  jnl_head += n + 2;
+  jnl_seq++;
+  jnl_commits++;
+  jnl_logged += n;
   return 0;
 }
 
-
 /*
-newInode function: create a new inode
-params: type
-return: inum on success, -1 on failure
+jnl_recover: replay every complete transaction logged since the last
+checkpoint, in order, stopping at the first torn or stale one
 */
-int new_inode(int type) {
-  debug("In new_inode: to create type %d. entering ...\n", type);
-  /* set in i-bitmap*/
-  if (highest_inode == (super.num_inodes - 1)) return -1;
+int jnl_recover() {
+  char *blk = (char *) malloc(UFS_BLOCK_SIZE);
+  disk_read(super.journal_addr, blk);
+  jsuper_t js = *(jsuper_t *) blk;
+  if (js.magic != JNL_MAGIC) {
+    fprintf(stderr, "jnl_recover: no journal header, formatting journal\n");
+    js.seq = 1;
+    js.start = 1;
+  }
+  int pos = js.start, seq = js.seq, replayed = 0;
+  while (pos + 2 <= super.journal_len) {
+    disk_read(super.journal_addr + pos, blk);
+    jdesc_t d = *(jdesc_t *) blk;
+    int n = d.nblocks;
+    if (d.magic != JNL_DESC || d.seq != seq || n <= 0 || n > JNL_MAX 
+      || pos + n + 2 > super.journal_len) break;
+
+    char *imgs = (char *) malloc((size_t) n * UFS_BLOCK_SIZE);
+    char **data = (char **) malloc(n * sizeof(char *));
+    bio_t *v = (bio_t *) malloc(n * sizeof(bio_t));
+    for (int i = 0; i < n; i++) {
+      data[i] = v[i].data = imgs + (size_t) i * UFS_BLOCK_SIZE;
+      v[i].blk = super.journal_addr + pos + 1 + i;
+    }
+    backend->read(v, n);
+    disk_read(super.journal_addr + pos + n + 1, blk);
+    jcommit_t *c = (jcommit_t *) blk;
+    int ok = c->magic == JNL_COMMIT && c->seq == seq && c->sum == jnl_sum(data, n);
+    if (ok) {
+      for (int i = 0; i < n; i++) v[i].blk = d.blocks[i];
+      backend->write(v, n);
+      replayed++;
+    }
+    free(v);
+    free(data);
+    free(imgs);
+    if (!ok) break;
+    pos += n + 2;
+    seq++;
+  }
+  free(blk);
+  if (replayed > 0) fprintf(stderr, "journal: replayed %d transactions\n", replayed);
+  jnl_seq = seq;
+  jnl_head = 1;
+  jnl_checkpoint(1);
+  return replayed;
+}
 
-  highest_inode += 1;
-  unsigned int bits;
-  fsread(bmaddr(super.inode_bitmap_addr, highest_inode), 
-    &bits, sizeof(unsigned int)); 
-  bits |= mask(highest_inode);
-  fswrite(bmaddr(super.inode_bitmap_addr, highest_inode), 
-    &bits, sizeof(unsigned int));
+/* lfs_defer: release blk once a checkpoint no longer referencing it is durable */
+void lfs_defer(int blk) {
+  if (blk < 0) return;
+  if (lfs_ndead == lfs_deadcap) {
+    lfs_deadcap = lfs_deadcap ? 2 * lfs_deadcap : 64;
+    lfs_dead = (int *) realloc(lfs_dead, lfs_deadcap * sizeof(int));
+  }
+  lfs_dead[lfs_ndead++] = blk;
+}
 
-  /* write in inode table */
-  inode_t newnd;
-  newnd.type = type;
-  newnd.size = 0;
+/* lfs_own: remember that inum's direct pointers refer to its data blocks */
+void lfs_own(int inum, inode_t *ind) {
+  if (ind->type == UFS_DIR_BTREE) return;
   for (int i = 0; i < DIRECT_PTRS; i++) {
-    newnd.direct[i] = -1;
+    int k = (int) ind->direct[i] - super.data_region_addr;
+    if (ind->direct[i] != -1 && k >= 0 && k < super.data_region_len) downer[k] = inum;
   }
-
-  fswrite(super.inode_region_addr * UFS_BLOCK_SIZE + highest_inode * sizeof(inode_t), 
-          &newnd, sizeof(inode_t));
-  
-  debug("In new_inode: inode created of inum %d. returning ...", highest_inode);
-  return highest_inode;
 }
 
-int end_serv() {
-  fsync(fd);
-  exit(0);
+/*
+lfs_load: rebuild the inode map from the log checkpoint
+Inodes the map locates in the log replace their inode table copies, the
+others have not moved since mkfs. Also works out which inode owns each
+data block and resumes the log tail where the checkpoint left it.
+*/
+int lfs_load() {
+  int ipb = UFS_BLOCK_SIZE / sizeof(inode_t);
+  lfs_imap = (N_Trace *) malloc(256 * sizeof(N_Trace));
+  lfs_iblk = (int *) malloc(super.inode_region_len * sizeof(int));
+  downer = (int *) malloc(super.data_region_len * sizeof(int));
+  dfresh = (unsigned char *) calloc(super.data_region_len, 1);
+  char *blk = (char *) malloc(UFS_BLOCK_SIZE);
+  if (lfs_imap == NULL || lfs_iblk == NULL || downer == NULL || dfresh == NULL || blk == NULL) {
+    perror("lfs_load: out of memory");
+    return -1;
+  }
+  disk_read(super.log_checkpoint, blk);
+  lfs_ckpt = *(track_t *) blk;
+  memset(lfs_imap, 0xff, 256 * sizeof(N_Trace));
+  for (int g = 0; g < 4; g++) {
+    int a = lfs_ckpt.node_array[g * 64];
+    lfs_gblk[g] = a < 0 ? -1 : a / UFS_BLOCK_SIZE;
+    if (lfs_gblk[g] != -1) disk_read(lfs_gblk[g], (char *) &lfs_imap[g * 64]);
+  }
+  for (int b = 0; b < super.inode_region_len; b++) lfs_iblk[b] = -1;
+  int nlogged = 0;
+  for (int inum = 0; inum < super.num_inodes; inum++) {
+    int a = lfs_imap[inum / 16].inodes[inum % 16];
+    if (a < 0) continue;
+    if (lfs_iblk[inum / ipb] != a / UFS_BLOCK_SIZE) {
+      lfs_iblk[inum / ipb] = a / UFS_BLOCK_SIZE;
+      disk_read(a / UFS_BLOCK_SIZE, blk);
+    }
+    itable[inum] = *(inode_t *) (blk + a % UFS_BLOCK_SIZE);
+    nlogged++;
+  }
+  free(blk);
+
+  for (int k = 0; k < super.data_region_len; k++) downer[k] = -1;
+  for (int inum = 0; inum < super.num_inodes; inum++)
+    if (*bmword(ibitmap, inum) & mask(inum)) lfs_own(inum, &itable[inum]);
+  lfs_tail = lfs_ckpt.tfinal;
+  if (lfs_tail > super.data_region_addr && lfs_tail < super.data_region_addr + super.data_region_len)
+    dalloc.hint = (lfs_tail - super.data_region_addr) / 32;
+  dalloc.threaded = 1;
+  /* every inode table block and imap group, and one to spare */
+  lfs_hold = super.inode_region_len + 4 + 1;
+  debug("In lfs_load: %d inodes in the log, tail at %d\n", nlogged, lfs_tail);
+  return 0;
 }
 
-int initialize_serv(char* image_path) {
-  fd = open(image_path, O_RDWR | O_CREAT, S_IRWXU);
-
+/*
+lfs_flush: append everything modified since the last checkpoint to the log
+Overwritten file and directory blocks move to the log tail and their inode
+is pointed at the new copy. Every modified inode table block, then the imap
+pieces locating its inodes, are appended behind them, in blocks taken from
+the lfs_hold reserve. Bitmaps and B-tree nodes are still written in place.
+Once that batch is on disk the checkpoint is rewritten, and only then are
+the blocks it stopped referencing released. Until then the new imap is kept
+apart, so a failed write leaves the maps and every dirty block as they were.
+returns: number of blocks written, -1 if the write failed
+*/
+int lfs_flush() {
+  int ipb = UFS_BLOCK_SIZE / sizeof(inode_t);
+  int ifirst = super.inode_region_addr - meta_start;
+  int gdirty[4] = { 0, 0, 0, 0 };
+
+  /* keep room for the inode blocks and imap pieces; past that, overwrite in place */
+  int reserve = 4;
+  for (int b = 0; b < super.inode_region_len; b++) reserve += meta_dirty[ifirst + b];
+  for (int i = 0; i < bc_nframes && dalloc.nfree > reserve + 1; i++) {
+    bframe_t *f = &bc_frames[i];
+    if (f->blk == -1 || !f->dirty) continue;
+    int k = f->blk - super.data_region_addr;
+    if (k < 0 || k >= super.data_region_len || downer[k] == -1 || dfresh[k]) continue;
+    int inum = downer[k];
+    int nblk = dblk_take(0);
+    if (!meta_dirty[ifirst + inum / ipb]) reserve++;
+    for (int d = 0; d < DIRECT_PTRS; d++)
+      if (itable[inum].direct[d] == f->blk) itable[inum].direct[d] = nblk;
+    meta_mark(&itable[inum], sizeof(inode_t));
+    for (dent_t *e = dlist[inum]; e != NULL; e = e->dnext)
+      if (e->addr / UFS_BLOCK_SIZE == f->blk)
+        e->addr = nblk * UFS_BLOCK_SIZE + e->addr % UFS_BLOCK_SIZE;
+    downer[nblk - super.data_region_addr] = inum;
+    downer[k] = -1;
+    lfs_defer(f->blk);
+    bc_unhash(f);
+    f->blk = nblk;
+    f->hnext = bc_hash[nblk & bc_hmask];
+    bc_hash[nblk & bc_hmask] = f;
+    lfs_relocated++;
+  }
+
+  int *iblk = (int *) malloc(super.inode_region_len * sizeof(int));
+  N_Trace *imap = (N_Trace *) malloc(256 * sizeof(N_Trace));
+  track_t ckpt = lfs_ckpt;
+  int gblk[4];
+  int tail = lfs_tail;
+  memcpy(iblk, lfs_iblk, super.inode_region_len * sizeof(int));
+  memcpy(imap, lfs_imap, 256 * sizeof(N_Trace));
+  memcpy(gblk, lfs_gblk, sizeof(gblk));
+  bio_t *v = (bio_t *) malloc((meta_len + bc_nframes + 4) * sizeof(bio_t));
+  int n = 0;
+  for (int b = 0; b < super.inode_region_len; b++) {
+    if (!meta_dirty[ifirst + b]) continue;
+    int nblk = dblk_take(0);
+    iblk[b] = nblk;
+    for (int inum = b * ipb; inum < (b + 1) * ipb && inum < super.num_inodes; inum++) {
+      imap[inum / 16].inodes[inum % 16] = nblk * UFS_BLOCK_SIZE + (inum % ipb) * sizeof(inode_t);
+      gdirty[inum / (16 * 64)] = 1;
+    }
+    v[n].blk = nblk;
+    v[n++].data = (char *) &itable[b * ipb];
+  }
+  for (int g = 0; g < 4; g++) {
+    if (!gdirty[g]) continue;
+    int nblk = dblk_take(0);
+    gblk[g] = nblk;
+    for (int j = g * 64; j < (g + 1) * 64; j++)
+      ckpt.node_array[j] = nblk * UFS_BLOCK_SIZE + (j % 64) * sizeof(N_Trace);
+    v[n].blk = nblk;
+    v[n++].data = (char *) &imap[g * 64];
+  }
+  for (int i = 0; i < meta_len; i++) {
+    if (!meta_dirty[i] || (i >= ifirst && i < ifirst + super.inode_region_len)) continue;
+    v[n].blk = meta_start + i;
+    v[n++].data = meta + (size_t) i * UFS_BLOCK_SIZE;
+  }
+  int nmeta = n;
+  for (int i = 0; i < bc_nframes; i++) {
+    if (bc_frames[i].blk == -1 || !bc_frames[i].dirty) continue;
+    v[n].blk = bc_frames[i].blk;
+    v[n++].data = bc_frames[i].data;
+  }
+  if (n == 0 && lfs_ndead == 0) {
+    free(iblk);
+    free(imap);
+    free(v);
+    return 0;
+  }
+  int appended = 0;
+  for (int i = 0; i < n; i++) {
+    int k = v[i].blk - super.data_region_addr;
+    if (k >= 0 && k < super.data_region_len && dfresh[k]) appended++;
+  }
+  qsort(v, n, sizeof(bio_t), bio_cmp);
+  int rc = n > 0 ? backend->write(v, n) : 0;
+  free(v);
+  if (rc >= 0 && fdatasync(fd) == 0) {
+    char *ck = (char *) calloc(1, UFS_BLOCK_SIZE);
+    ckpt.tfinal = lfs_tail;
+    ckpt.inode_count = super.num_inodes - ialloc.nfree;
+    memcpy(ck, &ckpt, sizeof(track_t));
+    rc = disk_write(super.log_checkpoint, ck) < 0 || fdatasync(fd) < 0 ? -1 : 0;
+    free(ck);
+  } else {
+    rc = -1;
+  }
+  if (rc < 0) {
+    fprintf(stderr, "lfs_flush: log write failed, keeping the old checkpoint\n");
+    for (int b = 0; b < super.inode_region_len; b++)
+      if (iblk[b] != lfs_iblk[b]) free_dblk(iblk[b]);
+    for (int g = 0; g < 4; g++)
+      if (gblk[g] != lfs_gblk[g]) free_dblk(gblk[g]);
+    lfs_tail = tail;
+    free(iblk);
+    free(imap);
+    return -1;
+  }
+
+  for (int b = 0; b < super.inode_region_len; b++)
+    if (iblk[b] != lfs_iblk[b]) lfs_defer(lfs_iblk[b]);
+  for (int g = 0; g < 4; g++)
+    if (gblk[g] != lfs_gblk[g]) lfs_defer(lfs_gblk[g]);
+  memcpy(lfs_iblk, iblk, super.inode_region_len * sizeof(int));
+  memcpy(lfs_imap, imap, 256 * sizeof(N_Trace));
+  memcpy(lfs_gblk, gblk, sizeof(gblk));
+  lfs_ckpt = ckpt;
+  free(iblk);
+  free(imap);
+  memset(meta_dirty, 0, meta_len);
+  for (int i = 0; i < bc_nframes; i++) bc_frames[i].dirty = 0;
+  meta_flushed += nmeta;
+  bc_writebacks += n - nmeta;
+  lfs_appended += appended;
+  lfs_checkpoints++;
+
+  for (int i = 0; i < lfs_ndead; i++) {
+    bc_discard(lfs_dead[i]);
+    bm_free(&dalloc, lfs_dead[i] - super.data_region_addr);
+  }
+  lfs_ndead = 0;
+  memset(dfresh, 0, super.data_region_len);
+  debug("In lfs_flush: wrote %d blocks, tail at %d\n", n, lfs_tail);
+  return n;
+}
+
+/*
+fs_flush: push modified blocks to the image
+Dirty metadata blocks and dirty cache frames go to the backend as one batch
+in block order; with a journal the batch is committed to the log first, as
+one transaction (dirty_reserve keeps it small enough), and nothing is
+written in place unless that commit succeeded.
+In mmap mode the mapping is msync'ed instead.
+returns: number of blocks written, -1 if the commit or the write failed
+    and every block is still dirty
+*/
+int fs_flush() {
+  last_flush = time(NULL);
+  if (image != NULL) {
+    ndirty = 0;
+    memset(meta_dirty, 0, meta_len);
+    return msync(image, image_len, MS_SYNC);
+  }
+  if (lfs_active) {
+    int rc = lfs_flush();
+    if (rc >= 0) ndirty = 0;
+    return rc;
+  }
+  bio_t *v = (bio_t *) malloc((meta_len + bc_nframes + 1) * sizeof(bio_t));
+  int n = 0;
+  for (int i = 0; i < meta_len; i++) {
+    if (!meta_dirty[i]) continue;
+    v[n].blk = meta_start + i;
+    v[n++].data = meta + (size_t) i * UFS_BLOCK_SIZE;
+  }
+  int nmeta = n;
+  for (int i = 0; i < bc_nframes; i++) {
+    if (bc_frames[i].blk == -1 || !bc_frames[i].dirty) continue;
+    v[n].blk = bc_frames[i].blk;
+    v[n++].data = bc_frames[i].data;
+  }
+  qsort(v, n, sizeof(bio_t), bio_cmp);
+  if (jnl_active && n > 0 && jnl_commit(v, n) < 0) {
+    fprintf(stderr, "fs_flush: commit failed, %d blocks stay dirty\n", n);
+    free(v);
+    return -1;
+  }
+  if (n > 0 && backend->write(v, n) < 0) {
+    fprintf(stderr, "fs_flush: %s write-back failed, %d blocks stay dirty\n", backend->name, n);
+    free(v);
+    return -1;
+  }
+  ndirty = 0;
+  memset(meta_dirty, 0, meta_len);
+  for (int i = 0; i < bc_nframes; i++) bc_frames[i].dirty = 0;
+  meta_flushed += nmeta;
+  bc_writebacks += n - nmeta;
+  free(v);
+  debug("In fs_flush: wrote %d blocks (%d metadata)\n", n, nmeta);
+  return n;
+}
+
+/*
+fsread / fswrite: byte-addressed access to the image through the block cache
+returns: nbytes
+*/
+int fsread(int addr, void *ptr, size_t nbytes) {
+  char *dst = (char *) ptr;
+  size_t done = 0;
+  while (done < nbytes) {
+    unsigned int off = (addr + done) % UFS_BLOCK_SIZE;
+    size_t len = UFS_BLOCK_SIZE - off;
+    if (len > nbytes - done) len = nbytes - done;
+    char *p = blkget((addr + done) / UFS_BLOCK_SIZE, 1, 0);
+    memcpy(dst + done, p + off, len);
+    blkput(p);
+    done += len;
+  }
+  return nbytes;
+}
+
+int fswrite(unsigned int addr, void *ptr, size_t nbytes) {
+  debug("In fswrite: writing at addr %u.%d bytes %lu\n", 
+    addr / UFS_BLOCK_SIZE, addr % UFS_BLOCK_SIZE, nbytes);
+  char *src = (char *) ptr;
+  size_t done = 0;
+  while (done < nbytes) {
+    unsigned int off = (addr + done) % UFS_BLOCK_SIZE;
+    size_t len = UFS_BLOCK_SIZE - off;
+    if (len > nbytes - done) len = nbytes - done;
+    char *p = blkget((addr + done) / UFS_BLOCK_SIZE, len < UFS_BLOCK_SIZE, 1);
+    memcpy(p + off, src + done, len);
+    blkput(p);
+    done += len;
+  }
+  return nbytes;
+}
+
+void inode_dbg(int inum) {
+#ifdef DEBUG
+  inode_t ind;
+  if (read_inode(inum, &ind) < 0) return;
+  debug("inum %d type: %d size: %d ", inum, ind.type, ind.size);
+  debug("direct: ");
+  for(int i = 0; i < DIRECT_PTRS; i++) {
+    debug("%d ", ind.direct[i]);
+  }
+  debug("\n");
+#endif
+}
+
+void dir_dbg(int inum) {
+#ifdef DEBUG
+  debug("inum %d dir entries: ", inum);
+  inode_t ind;
+  if (read_inode(inum, &ind) < 0) return;
+  for(int i = 0; i < (ind.size / sizeof(dir_ent_t)); i++) {
+    dir_ent_t de;
+    fsread(ind.direct[0] * UFS_BLOCK_SIZE + i * sizeof(dir_ent_t), 
+      &de, sizeof(dir_ent_t)); 
+    debug("%s %d, ", de.name, de.inum);
+  }
+  debug("\n");
+#endif
+}
+
+/* a 32-bit mask for a number starting from leftmost bit*/
+unsigned int mask(unsigned int num) {
+  return 0x1 << (8 * sizeof(unsigned int) - (num % (8 * sizeof(unsigned int))) - 1);
+}
+
+/* bmword: the bitmap word holding bit num */
+unsigned int *bmword(unsigned int *bitmap, unsigned int num) {
+  return &bitmap[num / (8 * sizeof(unsigned int))];
+}
+
+/*
+bm_init: set up an allocator over a resident bitmap and count its free bits
+*/
+void bm_init(bmalloc_t *b, unsigned int *bits, int nbits) {
+  b->bits = bits;
+  b->nbits = nbits;
+  b->hint = 0;
+  b->threaded = 0;
+  b->nfree = nbits;
+  int nwords = (nbits + 31) / 32;
+  for (int i = 0; i < nwords; i++) {
+    unsigned int w = bits[i];
+    if (i == nwords - 1 && nbits % 32) w &= ~0U << (32 - nbits % 32);
+    b->nfree -= __builtin_popcount(w);
+  }
+}
+
+/* bm_word: bitmap word i, with the bits past nbits reading as allocated */
+unsigned int bm_word(bmalloc_t *b, int i) {
+  int valid = b->nbits - i * 32;
+  return valid >= 32 ? b->bits[i] : b->bits[i] | (0xffffffffU >> valid);
+}
+
+/*
+bm_alloc: find, set and return the first clear bit at or after the hint
+Scans two bitmap words at a time as one 64-bit word, wrapping around to
+word 0, until every word has been looked at. Numbers are stored MSB-first,
+so the first clear bit is the count of leading ones.
+returns: bit number, -1 if the bitmap is full
+*/
+int bm_alloc(bmalloc_t *b) {
+  if (b->nfree == 0) return -1;
+  int nwords = (b->nbits + 31) / 32;
+  for (int n = 0; n < nwords; n += 2) {
+    int i = (b->hint + n) % nwords;
+    int j = (i + 1) % nwords;
+    unsigned long long w = (unsigned long long) bm_word(b, i) << 32 | bm_word(b, j);
+    if (~w == 0) continue;
+    int k = __builtin_clzll(~w);
+    int num = (k < 32 ? i : j) * 32 + k % 32;
+    b->bits[num / 32] |= mask(num);
+    meta_mark(&b->bits[num / 32], sizeof(unsigned int));
+    b->hint = num / 32;
+    b->nfree--;
+    return num;
+  }
+  return -1;
+}
+
+/* bm_free: clear bit num and let the next search start no later than it */
+void bm_free(bmalloc_t *b, int num) {
+  if (num < 0 || num >= b->nbits || !(b->bits[num / 32] & mask(num))) return;
+  b->bits[num / 32] &= ~mask(num);
+  meta_mark(&b->bits[num / 32], sizeof(unsigned int));
+  if (!b->threaded && num / 32 < b->hint) b->hint = num / 32;
+  b->nfree++;
+}
+
+/*
+read_inode: copy an allocated inode out of the resident inode table
+returns: 0 on success, -1 if inum is out of range or not allocated
+*/
+int read_inode(unsigned int inum, inode_t * ind) {
+  if (inum >= super.num_inodes || !(*bmword(ibitmap, inum) & mask(inum)))
+    return -1;
+  *ind = itable[inum];
+  return 0;
+}
+
+void write_inode(int inum, inode_t *inode) {
+  itable[inum] = *inode;
+  meta_mark(&itable[inum], sizeof(inode_t));
+  if (lfs_active) lfs_own(inum, inode);
+}
+
+/* dhash: FNV-1a over the name, seeded with the parent inum */
+unsigned int dhash(int pinum, char *name) {
+  unsigned int h = 2166136261u ^ (unsigned int) pinum;
+  for (; *name; name++) {
+    h ^= (unsigned char) *name;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int dindex_init() {
+  dindex_mask = 1023;
+  dindex = (dent_t **) calloc(dindex_mask + 1, sizeof(dent_t *));
+  dlist = (dent_t **) calloc(super.num_inodes, sizeof(dent_t *));
+  dindexed = (unsigned char *) calloc(super.num_inodes, 1);
+  if (dindex == NULL || dlist == NULL || dindexed == NULL) {
+    perror("dindex_init: out of memory");
+    return -1;
+  }
+  return 0;
+}
+
+/* dindex_grow: double the bucket count once chains average two entries */
+void dindex_grow() {
+  unsigned int nmask = dindex_mask * 2 + 1;
+  dent_t **nidx = (dent_t **) calloc(nmask + 1, sizeof(dent_t *));
+  if (nidx == NULL) return;
+  for (unsigned int b = 0; b <= dindex_mask; b++) {
+    dent_t *e = dindex[b];
+    while (e != NULL) {
+      dent_t *next = e->next;
+      e->next = nidx[e->hash & nmask];
+      nidx[e->hash & nmask] = e;
+      e = next;
+    }
+  }
+  free(dindex);
+  dindex = nidx;
+  dindex_mask = nmask;
+}
+
+void dindex_add(int pinum, char *name, int inum, unsigned int addr) {
+  dent_t *e = (dent_t *) malloc(sizeof(dent_t));
+  e->pinum = pinum;
+  e->inum = inum;
+  e->hash = dhash(pinum, name);
+  e->addr = addr;
+  strncpy(e->name, name, sizeof(e->name) - 1);
+  e->name[sizeof(e->name) - 1] = '\0';
+  e->next = dindex[e->hash & dindex_mask];
+  dindex[e->hash & dindex_mask] = e;
+  e->dnext = dlist[pinum];
+  dlist[pinum] = e;
+  if (++dindex_count > 2 * (dindex_mask + 1)) dindex_grow();
+}
+
+dent_t *dindex_find(int pinum, char *name) {
+  unsigned int h = dhash(pinum, name);
+  dent_t *e = dindex[h & dindex_mask];
+  while (e != NULL && 
+    (e->hash != h || e->pinum != pinum || strcmp(e->name, name) != 0)) e = e->next;
+  return e;
+}
+
+void dindex_unhash(dent_t *e) {
+  dent_t **pp = &dindex[e->hash & dindex_mask];
+  while (*pp != e) pp = &(*pp)->next;
+  *pp = e->next;
+  dindex_count--;
+}
+
+void dindex_remove(int pinum, char *name) {
+  dent_t *e = dindex_find(pinum, name);
+  if (e == NULL) return;
+  dindex_unhash(e);
+  dent_t **pp = &dlist[pinum];
+  while (*pp != e) pp = &(*pp)->dnext;
+  *pp = e->dnext;
+  free(e);
+}
+
+/* dindex_drop: forget a directory's entries, e.g. when its inode is freed */
+void dindex_drop(int inum) {
+  dent_t *e = dlist[inum];
+  while (e != NULL) {
+    dent_t *next = e->dnext;
+    dindex_unhash(e);
+    free(e);
+    e = next;
+  }
+  dlist[inum] = NULL;
+  dindexed[inum] = 0;
+}
+
+/*
+dindex_load: read a directory's blocks once and index its live entries
+*/
+void dindex_load(int pinum, inode_t *nd) {
+  unsigned int mxb = ceil(1.0 * nd->size / UFS_BLOCK_SIZE); 
+  for (int i = 0; i < mxb; i++) {
+    dir_block_t *db = (dir_block_t *) blkget(nd->direct[i], 1, 0);
+    for (int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
+      unsigned int off = i * UFS_BLOCK_SIZE + j * sizeof(dir_ent_t);
+      if (off >= nd->size) break;
+      if (db->entries[j].inum == -1) continue;
+      dindex_add(pinum, db->entries[j].name, db->entries[j].inum, 
+        nd->direct[i] * UFS_BLOCK_SIZE + j * sizeof(dir_ent_t));
+    }
+    blkput((char *) db);
+  }
+  dindexed[pinum] = 1;
+  debug("In dindex_load: indexed directory %d\n", pinum);
+}
+
+/*
+bt_find: position of the first entry in a node whose name is >= name
+*/
+int bt_find(bt_node_t *n, char *name) {
+  int lo = 0, hi = n->nkeys;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (strcmp(n->ents[mid].name, name) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/* bt_child: index of the child of an interior node that covers name */
+int bt_child(bt_node_t *n, char *name) {
+  int i = bt_find(n, name);
+  if (i < n->nkeys && strcmp(n->ents[i].name, name) == 0) return i;
+  return i > 0 ? i - 1 : 0;
+}
+
+void bt_read(int blk, bt_node_t *n) {
+  fsread(blk * UFS_BLOCK_SIZE, n, sizeof(bt_node_t));
+}
+
+void bt_write(int blk, bt_node_t *n) {
+  fswrite(blk * UFS_BLOCK_SIZE, n, sizeof(bt_node_t));
+}
+
+/* bt_init: make n an empty node */
+void bt_init(bt_node_t *n, int leaf) {
+  n->magic = BT_MAGIC;
+  n->leaf = leaf;
+  n->nkeys = 0;
+  n->next = -1;
+}
+
+int bt_new(bt_node_t *n, int leaf) {
+  int blk = alloc_dblk();
+  if (blk == -1) return -1;
+  bt_init(n, leaf);
+  return blk;
+}
+
+/*
+bt_splits: how many new nodes inserting name under root takes: one for each
+full node at the bottom of its path, which will split, and a new root if
+the whole path is full
+*/
+int bt_splits(int root, char *name) {
+  int depth = 0, full = 0;
+  bt_node_t *n = (bt_node_t *) blkget(root, 1, 0);
+  while (1) {
+    depth++;
+    full = n->nkeys < BT_MAX ? 0 : full + 1;
+    if (n->leaf) break;
+    int child = n->ents[bt_child(n, name)].inum;
+    blkput((char *) n);
+    n = (bt_node_t *) blkget(child, 1, 0);
+  }
+  blkput((char *) n);
+  return full == depth ? full + 1 : full;
+}
+
+/*
+bt_lookup: find name in the B-tree rooted at root
+returns: inum, -1 if not found; addr is set to the entry's image address
+*/
+int bt_lookup(int root, char *name, unsigned int *addr) {
+  int blk = root;
+  bt_node_t *n = (bt_node_t *) blkget(blk, 1, 0);
+  while (!n->leaf) {
+    blk = n->ents[bt_child(n, name)].inum;
+    blkput((char *) n);
+    n = (bt_node_t *) blkget(blk, 1, 0);
+  }
+  int i = bt_find(n, name);
+  int inum = -1;
+  if (i < n->nkeys && strcmp(n->ents[i].name, name) == 0) {
+    *addr = blk * UFS_BLOCK_SIZE + ((char *) &n->ents[i] - (char *) n);
+    inum = n->ents[i].inum;
+  }
+  blkput((char *) n);
+  return inum;
+}
+
+/*
+bt_insert_rec: insert e under node blk, taking the nodes splits need from
+the *nspare blocks in spare
+returns: 0, 1 if the node split (split holds the new right node and its
+lowest name), -1 if the name exists
+*/
+int bt_insert_rec(int blk, dir_ent_t *e, dir_ent_t *split, int *spare, int *nspare) {
+  bt_node_t n;
+  bt_read(blk, &n);
+  int i;
+  dir_ent_t ins = *e;
+  if (n.leaf) {
+    i = bt_find(&n, e->name);
+    if (i < n.nkeys && strcmp(n.ents[i].name, e->name) == 0) return -1;
+  } else {
+    i = bt_child(&n, e->name);
+    dir_ent_t csplit;
+    int rc = bt_insert_rec(n.ents[i].inum, e, &csplit, spare, nspare);
+    if (rc <= 0) return rc;
+    ins = csplit;
+    i++;
+  }
+
+  if (n.nkeys < BT_MAX) {
+    memmove(&n.ents[i + 1], &n.ents[i], (n.nkeys - i) * sizeof(dir_ent_t));
+    n.ents[i] = ins;
+    n.nkeys++;
+    bt_write(blk, &n);
+    return 0;
+  }
+
+  /* full: move the upper half to a new right sibling, then insert */
+  bt_node_t r;
+  int rblk = spare[--*nspare];
+  bt_init(&r, n.leaf);
+  int half = n.nkeys / 2;
+  r.nkeys = n.nkeys - half;
+  memcpy(r.ents, &n.ents[half], r.nkeys * sizeof(dir_ent_t));
+  n.nkeys = half;
+  if (n.leaf) {
+    r.next = n.next;
+    n.next = rblk;
+  }
+  bt_node_t *t = i <= half ? &n : &r;
+  if (t == &r) i -= half;
+  memmove(&t->ents[i + 1], &t->ents[i], (t->nkeys - i) * sizeof(dir_ent_t));
+  t->ents[i] = ins;
+  t->nkeys++;
+  bt_write(blk, &n);
+  bt_write(rblk, &r);
+  strcpy(split->name, r.ents[0].name);
+  split->inum = rblk;
+  return 1;
+}
+
+/*
+bt_insert: add an entry to a B-tree directory, growing a new root on a root split
+returns: 0 on success, -1 if the name exists or the image is out of blocks
+*/
+int bt_insert(inode_t *nd, dir_ent_t *e) {
+  /* take every block the splits need before touching the tree */
+  int spare[BT_DEPTH_MAX];
+  int need = bt_splits(nd->direct[0], e->name), nspare = 0;
+  if (need > BT_DEPTH_MAX) return -1;
+  while (nspare < need && (spare[nspare] = alloc_dblk()) != -1) nspare++;
+  dir_ent_t split;
+  int rc = nspare < need ? -1 : bt_insert_rec(nd->direct[0], e, &split, spare, &nspare);
+  if (rc <= 0) {
+    while (nspare > 0) free_dblk(spare[--nspare]);
+    return rc;
+  }
+  bt_node_t root;
+  int rblk = spare[--nspare];
+  bt_init(&root, 0);
+  root.nkeys = 2;
+  strcpy(root.ents[0].name, "");
+  root.ents[0].inum = nd->direct[0];
+  root.ents[1] = split;
+  bt_write(rblk, &root);
+  nd->direct[0] = rblk;
+  return 0;
+}
+
+/*
+bt_delete: remove name from its leaf. Nodes are not merged; an emptied leaf
+stays in the tree and is reused by later inserts.
+*/
+int bt_delete(int root, char *name) {
+  int blk = root;
+  bt_node_t *p = (bt_node_t *) blkget(blk, 1, 0);
+  while (!p->leaf) {
+    blk = p->ents[bt_child(p, name)].inum;
+    blkput((char *) p);
+    p = (bt_node_t *) blkget(blk, 1, 0);
+  }
+  blkput((char *) p);
+  bt_node_t n;
+  bt_read(blk, &n);
+  int i = bt_find(&n, name);
+  if (i == n.nkeys || strcmp(n.ents[i].name, name) != 0) return -1;
+  memmove(&n.ents[i], &n.ents[i + 1], (n.nkeys - i - 1) * sizeof(dir_ent_t));
+  n.nkeys--;
+  bt_write(blk, &n);
+  return 0;
+}
+
+void bt_free(int blk) {
+  bt_node_t n;
+  bt_read(blk, &n);
+  if (!n.leaf)
+    for (int i = 0; i < n.nkeys; i++) bt_free(n.ents[i].inum);
+  free_dblk(blk);
+}
+
+/*
+bt_convert: rebuild a linear directory as a B-tree
+The old blocks are only released once every entry is in the tree.
+returns: 0 on success, -1 if the image ran out of blocks
+*/
+int bt_convert(int pinum, inode_t *nd) {
+  debug("In bt_convert: converting directory %d (%d bytes)\n", pinum, nd->size);
+  inode_t t = *nd;
+  bt_node_t root;
+  t.direct[0] = bt_new(&root, 1);
+  if (t.direct[0] == -1) return -1;
+  bt_write(t.direct[0], &root);
+  t.size = 0;
+
+  unsigned int mxb = ceil(1.0 * nd->size / UFS_BLOCK_SIZE);
+  for (int i = 0; i < mxb; i++) {
+    dir_block_t db;
+    fsread(nd->direct[i] * UFS_BLOCK_SIZE, &db, sizeof(dir_block_t));
+    for (int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++) {
+      if (i * UFS_BLOCK_SIZE + j * sizeof(dir_ent_t) >= nd->size) break;
+      if (db.entries[j].inum == -1) continue;
+      if (bt_insert(&t, &db.entries[j]) < 0) {
+        bt_free(t.direct[0]);
+        return -1;
+      }
+      t.size += sizeof(dir_ent_t);
+    }
+  }
+
+  for (int i = 0; i < DIRECT_PTRS; i++) {
+    if (nd->direct[i] != -1) free_dblk(nd->direct[i]);
+    nd->direct[i] = -1;
+  }
+  nd->direct[0] = t.direct[0];
+  nd->size = t.size;
+  nd->type = UFS_DIR_BTREE;
+  write_inode(pinum, nd);
+  pthread_mutex_lock(&dindex_lock);
+  dindex_drop(pinum);
+  pthread_mutex_unlock(&dindex_lock);
+  return 0;
+}
+
+/*
+lookup_file: Find a file in a parent directory
+params: parent-inum, file-name, 
+returns: dir_ent and addr if found, 
+    NULL if par inode not found, par inode not dir or file not found
+
+Hashes (pinum, name) into the directory index, which is filled from the
+directory blocks the first time the directory is looked up. B-tree
+directories are searched directly.
+*/
+dir_ent_t* lookup_file(int pinum, char* name, unsigned int *addr){
+  debug("In lookup_file: pinum %d name %s. entering ...\n", pinum, name);
+  inode_t nd;
+  if(read_inode(pinum, &nd) < 0 || !is_dir(nd.type)) return NULL;
+  if (nd.type == UFS_DIR_BTREE) {
+    int inum = bt_lookup(nd.direct[0], name, addr);
+    if (inum == -1) return NULL;
+    dir_ent_t * de = (dir_ent_t *) malloc(sizeof(dir_ent_t));
+    strcpy(de->name, name);
+    de->inum = inum;
+    return de;
+  }
+  pthread_mutex_lock(&dindex_lock);
+  if (!dindexed[pinum]) dindex_load(pinum, &nd);
+
+  dent_t *e = dindex_find(pinum, name);
+  if (e == NULL) {
+    pthread_mutex_unlock(&dindex_lock);
+    debug("In lookup_file: file not found. returning NULL\n");
+    return NULL;
+  }
+  debug("In lookup_file: file found. inum %d addr %u. returning ...\n", e->inum, e->addr);
+  dir_ent_t * de = (dir_ent_t *) malloc(sizeof(dir_ent_t));
+  strcpy(de->name, e->name);
+  de->inum = e->inum;
+  *addr = e->addr;
+  pthread_mutex_unlock(&dindex_lock);
+  return de;
+}
+
+/*
+creat_file: Create a new regular file or directory in a parent dir
+params: parent inum, new-file type, new-file name
+return: 0 on success, -1 on failure
+*/
+int creat_file(int pinum, int type, char *name) {
+  debug("In creat_file: to create file %s. entering ...\n", name);
+  /* Check if par is dir*/
+  inode_t pnd;
+  if(read_inode(pinum, &pnd) < 0 || !is_dir(pnd.type)) return -1;
+  if (type != UFS_DIRECTORY && type != UFS_REGULAR_FILE) return -1;
+
+  /* Check if name already exists */
+  unsigned int addr;
+  dir_ent_t* lde = lookup_file(pinum, name, &addr);
+  if (lde != NULL) {
+    free(lde);
+    return 0;
+  }
+
+  int ninum = new_inode(type);
+  if (ninum == -1) return -1;
+
+  /* if new dir, add . and .. */
+  if (type == UFS_DIRECTORY) {
+    inode_t nnd;
+    read_inode(ninum, &nnd);
+
+    int ndb = alloc_dblk();
+    if (ndb == -1) {
+      free_inode(ninum);
+      return -1;
+    }
+    nnd.direct[0] = ndb;
+    
+    dir_block_t db;
+    strcpy(db.entries[0].name, "."); 
+    db.entries[0].inum = ninum;
+    strcpy(db.entries[1].name, "..");
+    db.entries[1].inum = pinum; 
+    for (int i = 2; i < UFS_BLOCK_SIZE / sizeof(dir_ent_t); i++)
+      db.entries[i].inum = -1;
+    fswrite(ndb * UFS_BLOCK_SIZE, &db, sizeof(dir_block_t));
+    nnd.size = 2 * sizeof(dir_ent_t);
+    write_inode(ninum, &nnd);
+    pthread_mutex_lock(&dindex_lock);
+    dindex_add(ninum, ".", ninum, ndb * UFS_BLOCK_SIZE);
+    dindex_add(ninum, "..", pinum, ndb * UFS_BLOCK_SIZE + sizeof(dir_ent_t));
+    dindexed[ninum] = 1;
+    pthread_mutex_unlock(&dindex_lock);
+  }
+
+  /* write in parent data*/
+  dir_ent_t de;
+  de.inum = ninum;
+  strcpy(de.name, name);
+  /* a failed conversion leaves the linear directory as it was */
+  if (pnd.type == UFS_DIRECTORY && pnd.size + sizeof(dir_ent_t) > btree_threshold * UFS_BLOCK_SIZE
+      && bt_convert(pinum, &pnd) < 0) {
+    free_inode(ninum);
+    return -1;
+  }
+  if (pnd.type == UFS_DIR_BTREE) {
+    if (bt_insert(&pnd, &de) < 0) {
+      free_inode(ninum);
+      return -1;
+    }
+    pnd.size += sizeof(dir_ent_t);
+    write_inode(pinum, &pnd);
+    debug("In creat_file: file created in B-tree dir. returning ...\n");
+    return 0;
+  }
+  if (write_file(pinum, &de, pnd.size, sizeof(dir_ent_t), UFS_DIRECTORY) < 0) {
+    free_inode(ninum);
+    return -1;
+  }
+  read_inode(pinum, &pnd);
+  unsigned int off = pnd.size - sizeof(dir_ent_t);
+  pthread_mutex_lock(&dindex_lock);
+  dindex_add(pinum, name, ninum, 
+    pnd.direct[off / UFS_BLOCK_SIZE] * UFS_BLOCK_SIZE + off % UFS_BLOCK_SIZE);
+  pthread_mutex_unlock(&dindex_lock);
+  debug("In creat_file: file created. returning ...\n");
+  return 0; 
+}
+
+/*
+write_file
+param: inode-num, offset (0-indexed), data, nbytes
+returns: 0 on success, -1 on failure
+
+Walks the blocks covering the range once, adding a data block wherever
+there is none yet. Updates size and direct fields of a inode.
+*/
+
+int write_file(int inum, void *buf, unsigned int offset, int nbytes, int type) {
+  debug("In write_file: write inode %d at addr %u. entering ...\n", inum, offset);
+  char *src = (char *) buf;
+
+  inode_t nd;
+  inode_t *fnd = &nd;
+  if (read_inode(inum, fnd) < 0 || fnd->type != type) return -1;
+  inode_dbg(inum);
+
+  int ofd = offset / UFS_BLOCK_SIZE;
+  if (nbytes < 0 || ofd > (DIRECT_PTRS - 1)) return -1;
+  if (nbytes > 0 && (offset + nbytes - 1) / UFS_BLOCK_SIZE > DIRECT_PTRS - 1) return -1;
+
+  int d = ofd;
+  while(d >= 0 && fnd->direct[d] == -1) {
+    unsigned int ndb = alloc_dblk();
+    if (ndb == -1) {
+      write_inode(inum, fnd);
+      return -1;
+    }
+    debug("In write_file: adding new dblk %u to inum %d direct[%u].\n", ndb, inum, d);
+    zero_dblk(ndb);
+    fnd->direct[d] = ndb;
+    d--;
+  }
+  /* the inode goes out once, after the data and its new size */
+  int done = 0;
+  for (int b = ofd; done < nbytes; b++) {
+    unsigned int ofr = (offset + done) % UFS_BLOCK_SIZE;
+    int len = UFS_BLOCK_SIZE - ofr;
+    if (len > nbytes - done) len = nbytes - done;
+    if (fnd->direct[b] == -1) {
+      int ndb = alloc_dblk();
+      if (ndb == -1) {
+        write_inode(inum, fnd);
+        return -1;
+      }
+      if (len < UFS_BLOCK_SIZE) zero_dblk(ndb);
+      fnd->direct[b] = ndb;
+    }
+    fswrite(fnd->direct[b] * UFS_BLOCK_SIZE + ofr, src + done, len);
+    done += len;
+  }
+  fnd->size = (offset + nbytes) > fnd->size ? offset + nbytes: fnd->size;
+  write_inode(inum, fnd);
+  inode_dbg(inum);
+  if(type == UFS_DIRECTORY) dir_dbg(inum);
+  debug("In write_file. returning ...\n");
+  return 0;
+}
+
+/*
+free_dblk: return a data block (by address) to the data bitmap
+In log mode a block the last checkpoint may still reference is only
+released after the next one.
+*/
+void free_dblk(int blk) {
+  int k = blk - super.data_region_addr;
+  pthread_mutex_lock(&alloc_lock);
+  if (lfs_active && k >= 0 && k < super.data_region_len) {
+    downer[k] = -1;
+    bc_discard(blk);
+    if (!dfresh[k]) lfs_defer(blk);
+    else bm_free(&dalloc, k);
+  } else {
+    bm_free(&dalloc, k);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+/* zero_dblk: clear a newly allocated data block, which may hold a deleted file's data */
+void zero_dblk(int blk) {
+  char *p = blkget(blk, 0, 1);
+  memset(p, 0, UFS_BLOCK_SIZE);
+  blkput(p);
+}
+
+/*
+newDataBlock function: returns block address.
+    - Find a free data block from data bitmap
+    - Set bit to 1 for this data block in data bitmap
+    - data block address = (super.data_region_addr + bit index in bitmap) * block_size
+    
+*/
+int alloc_dblk() {
+  return dblk_take(lfs_hold);
+}
+
+/* dblk_take: alloc_dblk, failing once no more than keep blocks are left
+(the log takes its own blocks with keep = 0) */
+int dblk_take(int keep) {
+  debug("In alloc_dblk: entering ...\n");
+  /* set in d-bitmap */
+  pthread_mutex_lock(&alloc_lock);
+  int k = dalloc.nfree > keep ? bm_alloc(&dalloc) : -1;
+  if (k != -1 && lfs_active) {
+    dfresh[k] = 1;
+    lfs_tail = super.data_region_addr + k + 1;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  if (k == -1) return -1;
+  debug("In alloc_dblk: allocated dblk addr %d. returning ...\n", 
+    super.data_region_addr + k);
+  return super.data_region_addr + k;
+}
+
+/*
+read_file
+param: inode-num, buf, offset, nbytes
+returns: 0 on success, -1 on failure
+
+Reads any number of bytes with one walk over the blocks covering them.
+*/
+int read_file(int inum, char* buf, int offset, int nbytes) {
+  debug("In read_file: read inum %d at offset %u entering ...\n", inum, offset);
+  inode_t nd;
+  inode_t *fnd = &nd;
+  if (read_inode(inum, fnd) < 0) return -1;
+  inode_dbg(inum);
+
+  unsigned int rdb = offset / UFS_BLOCK_SIZE;
+  if (offset < 0 || nbytes < 0 || rdb > (DIRECT_PTRS - 1)) return -1;
+
+  int done = 0;
+  for (unsigned int b = rdb; done < nbytes; b++) {
+    if (b > DIRECT_PTRS - 1 || fnd->direct[b] == -1) return -1;
+    unsigned int rds = (offset + done) % UFS_BLOCK_SIZE;
+    int len = UFS_BLOCK_SIZE - rds;
+    if (len > nbytes - done) len = nbytes - done;
+    fsread(fnd->direct[b] * UFS_BLOCK_SIZE + rds, buf + done, len);
+    done += len;
+  }
+  debug("In read_file: file read. returning ...\n");
+  return 0;
+}
+
+/*
+params: parent inum, file-name
+
+Remove a regular file or directory name from the parent dir.
+
+- Get parent-inode from parent inum (call getInode)
+- Lookup file and get entry address of file (call lookupFile)
+- Cast entry to dir_ent_t and get inum.
+- Get inode from file-inum (call getInode)
+- If file type is dir and size > 0, throw err
+- Mark sizeof(dir_ent_t) bytes as invalid at entry address.
+- Release the file's inode and data blocks.
+- Return success
+*/
+int unlink_file(int pinum, char *name) {
+  debug("In unlink_file: entering ...\n");
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return -1;
+  unsigned int addr;
+  dir_ent_t *de = lookup_file(pinum, name, &addr);
+  if (de == NULL) return -1;
+
+  inode_t ind;
+  read_inode(de->inum, &ind);
+  debug("In unlink_file: to delete ");
+  inode_dbg(de->inum);
+  if (is_dir(ind.type) && ind.size > 2 * sizeof(dir_ent_t)) {
+    debug("In unlink_file. dir nonempty. returning ...\n");
+    free(de);
+    return -1;
+  }
+  /* the inode is released only once its entry is gone */
+  int inum = de->inum;
+
+  inode_t pnd;
+  read_inode(pinum, &pnd);
+  if (pnd.type == UFS_DIR_BTREE) {
+    free(de);
+    if (bt_delete(pnd.direct[0], name) < 0) return -1;
+    free_inode(inum);
+    pnd.size -= sizeof(dir_ent_t);
+    write_inode(pinum, &pnd);
+    debug("In unlink_file: unlinked from B-tree dir. returning ...\n");
+    return 0;
+  }
+
+  pthread_mutex_lock(&dindex_lock);
+  dindex_remove(pinum, name);
+  pthread_mutex_unlock(&dindex_lock);
+  strcpy(de->name, "");
+  de->inum = -1;
+  fswrite(addr, de, sizeof(dir_ent_t)); 
+  free(de);
+  free_inode(inum);
+
+  /* shrink the parent past trailing free entries and release emptied blocks */
+  int i;
+  for(i = 0; i < DIRECT_PTRS && pnd.direct[i] != -1; i++) {
+    if (pnd.direct[i] == (addr / UFS_BLOCK_SIZE)) 
+      break;
+  }
+  unsigned int offset = i * UFS_BLOCK_SIZE + addr % UFS_BLOCK_SIZE;
+  if (offset + sizeof(dir_ent_t) == pnd.size) {
+    while (pnd.size > 2 * sizeof(dir_ent_t)) {
+      unsigned int last = pnd.size - sizeof(dir_ent_t);
+      dir_ent_t le;
+      fsread(pnd.direct[last / UFS_BLOCK_SIZE] * UFS_BLOCK_SIZE + last % UFS_BLOCK_SIZE, 
+        &le, sizeof(dir_ent_t));
+      if (le.inum != -1) break;
+      pnd.size = last;
+    }
+    for (int b = (pnd.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE; b < DIRECT_PTRS; b++) {
+      if (pnd.direct[b] == -1) continue;
+      free_dblk(pnd.direct[b]);
+      pnd.direct[b] = -1;
+    }
+  }
+  write_inode(pinum, &pnd);
+  debug("In unlink_file: parent ");
+  inode_dbg(pinum);
+
+  debug("In unlink_file: unlinked. returning ...\n");
+  return 0;
+}
+
+
+/*
+free_inode: release an inode and every data block it points to
+*/
+void free_inode(int inum) {
+  inode_t ind;
+  if (read_inode(inum, &ind) < 0) return;
+  if (ind.type == UFS_DIR_BTREE) {
+    bt_free(ind.direct[0]);
+  } else {
+    for (int i = 0; i < DIRECT_PTRS; i++)
+      if (ind.direct[i] != -1) free_dblk(ind.direct[i]);
+  }
+  if (ind.type == UFS_DIRECTORY) {
+    pthread_mutex_lock(&dindex_lock);
+    dindex_drop(inum);
+    pthread_mutex_unlock(&dindex_lock);
+  }
+  pthread_mutex_lock(&alloc_lock);
+  bm_free(&ialloc, inum);
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+newInode function: create a new inode
+params: type
+return: inum on success, -1 on failure
+*/
+int new_inode(int type) {
+  debug("In new_inode: to create type %d. entering ...\n", type);
+  /* set in i-bitmap*/
+  pthread_mutex_lock(&alloc_lock);
+  int inum = bm_alloc(&ialloc);
+  pthread_mutex_unlock(&alloc_lock);
+  if (inum == -1) return -1;
+
+  /* write in inode table */
+  inode_t newnd;
+  newnd.type = type;
+  newnd.size = 0;
+  for (int i = 0; i < DIRECT_PTRS; i++) {
+    newnd.direct[i] = -1;
+  }
+
+  write_inode(inum, &newnd);
+  
+  debug("In new_inode: inode created of inum %d. returning ...", inum);
+  return inum;
+}
+
+int end_serv() {
+  int rc = fs_flush();
+  fsync(fd);
+  if (jnl_active && rc >= 0) jnl_checkpoint(jnl_head);
+  if (image == NULL) bc_report(stderr);
+  exit(0);
+}
+
+/* flush_due: the interval passed or, in log mode, a segment's worth of blocks is dirty */
+int flush_due() {
+  return time(NULL) - last_flush >= flush_secs || (lfs_active && ndirty >= bc_nframes / 2);
+}
+
+/*
+fs_tick: periodic work between requests
+Writes the cache back (or checkpoints the mapping) once the flush interval has passed.
+*/
+void fs_tick() {
+  if (report_stats) {
+    report_stats = 0;
+    if (image == NULL) bc_report(stderr);
+  }
+  if (flush_due()) {
+    pthread_rwlock_wrlock(&fs_lock);
+    if (flush_due()) fs_flush();
+    pthread_rwlock_unlock(&fs_lock);
+  }
+}
+
+/*
+op_blocks: most blocks one operation dirties, besides the bitmaps and
+converting its parent to a B-tree (see req_blocks)
+A write dirties the blocks it spans, the zeroed blocks filling any holes
+below them, and its inode's block. A creat or unlink
+dirties the two inodes' blocks and the parent's entries: a block of a linear
+directory, or a split (creat) or a delete (unlink) on each B-tree level.
+*/
+int op_blocks(int op, int offset, int nbytes) {
+  if (op == MFS_WRITE || op == MFS_WRITE_RANGE) {
+    long last = (long) (offset > 0 ? offset : 0) + (nbytes > 0 ? nbytes - 1 : 0);
+    int span = last / UFS_BLOCK_SIZE < DIRECT_PTRS ? last / UFS_BLOCK_SIZE + 1 : DIRECT_PTRS;
+    return span + 1;
+  }
+  if (op != MFS_CREAT && op != MFS_UNLINK) return 0;
+  int levels = 1;
+  for (long cap = BT_MAX; cap < super.num_inodes; cap *= BT_MAX / 2) levels++;
+  return 3 + (op == MFS_CREAT ? 2 * levels + 1 : levels);
+}
+
+/*
+req_blocks: most blocks a request can dirty, counting only the first nops
+operations of a MFS_COMPOUND (whose operations are in ops)
+Every bitmap block is counted once, and a creat also pays once per parent
+for converting it: half-full leaves for a full linear directory, an
+interior node per level, and the new entry's path.
+*/
+int req_blocks(int op, int offset, int nbytes, char *ops, int nops) {
+  int levels = 1;
+  for (long cap = BT_MAX; cap < super.num_inodes; cap *= BT_MAX / 2) levels++;
+  int convert = btree_threshold * UFS_BLOCK_SIZE / sizeof(dir_ent_t) / (BT_MAX / 2) + 1 + levels;
+  int n = 0;
+  if (op != MFS_COMPOUND) {
+    n = op_blocks(op, offset, nbytes) + (op == MFS_CREAT ? convert : 0);
+  } else {
+    int len = nbytes < 0 ? 0 : nbytes > MFS_BLOCK_SIZE ? MFS_BLOCK_SIZE : nbytes;
+    int parents[WIRE_OPS_MAX];
+    int nparents = 0, in = 0;
+    for (int k = 0; k < nops && k < WIRE_OPS_MAX && in + (int) sizeof(wire_op_t) <= len; k++) {
+      wire_op_t o;
+      memcpy(&o, ops + in, sizeof(o));
+      in += sizeof(o);
+      if (o.len > len - in) break;
+      in += o.len;
+      n += op_blocks(o.op, o.offset, o.nbytes);
+      if (o.op != MFS_CREAT) continue;
+      int key = o.ref >= 0 ? -1 - o.ref : o.inum, j = 0;
+      while (j < nparents && parents[j] != key) j++;
+      if (j < nparents) continue;
+      parents[nparents++] = key;
+      n += convert;
+    }
+  }
+  return n > 0 ? n + super.inode_bitmap_len + super.data_bitmap_len : 0;
+}
+
+/*
+dirty_reserve: admit a request that may dirty up to n blocks
+With a journal or log, dirty blocks stay cached until a flush, so no more
+than dirty_cap may be dirty or promised at once; when the budget is spent
+the blocks are flushed first, or, if running requests hold it, their end is
+awaited. Called without fs_lock.
+returns: 0 once admitted, -1 if n can never fit or the flush failed
+*/
+int dirty_reserve(int n) {
+  if (dirty_cap == 0 || n == 0) return 0;
+  if (n > dirty_cap) return -1;
+  pthread_mutex_lock(&reserve_lock);
+  while (ndirty + dirty_reserved + n > dirty_cap) {
+    if (dirty_reserved + n > dirty_cap) {
+      pthread_cond_wait(&reserve_cond, &reserve_lock);
+      continue;
+    }
+    pthread_mutex_unlock(&reserve_lock);
+    pthread_rwlock_wrlock(&fs_lock);
+    int rc = ndirty + dirty_reserved + n > dirty_cap ? fs_flush() : 0;
+    pthread_rwlock_unlock(&fs_lock);
+    if (rc < 0) return -1;
+    pthread_mutex_lock(&reserve_lock);
+  }
+  dirty_reserved += n;
+  pthread_mutex_unlock(&reserve_lock);
+  return 0;
+}
+
+/* dirty_release: an admitted request finished; return its reservation */
+void dirty_release(int n) {
+  if (dirty_cap == 0 || n == 0) return;
+  pthread_mutex_lock(&reserve_lock);
+  dirty_reserved -= n;
+  pthread_cond_broadcast(&reserve_cond);
+  pthread_mutex_unlock(&reserve_lock);
+}
+
+int initialize_serv(char* image_path) {
+  inval_seq = (unsigned int) time(NULL) << 10;
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&fs_lock, &attr);
+  for (int i = 0; i < ILOCKS; i++) pthread_rwlock_init(&ilocks[i], NULL);
+
+  fd = open(image_path, O_RDWR | O_CREAT, S_IRWXU);
+
   struct stat fs;
   if(fstat(fd, &fs) < 0) {
     perror("initialize_serv: Cannot open file");
   }
 
-  fsread(0, &super, sizeof(super_t));
-  debug("Read super block. Inode rgn addr: %d, #inodes: %d\n", 
-    super.inode_region_addr, super.num_inodes);
-  inode_dbg(0);
-	
+  if (pread(fd, &super, sizeof(super_t), 0) != sizeof(super_t)) {
+    perror("initialize_serv: Cannot read super block");
+    exit(1);
+  }
+  if (super.journal_len > 0) jnl_recover();
+  lfs_active = super.log_checkpoint > 0;
+  if (lfs_active && use_mmap) {
+    fprintf(stderr, "log-structured image, mmap mode not used\n");
+    use_mmap = 0;
+  }
+  if (use_mmap) {
+    if (map_image() < 0) exit(1);
+  } else if (bc_init(bc_nframes) < 0) exit(1);
+  if (use_uring && !use_mmap) {
+    if (uring_init() == 0) backend = &uring_backend;
+    else fprintf(stderr, "io_uring unavailable, using pread/pwrite\n");
+  }
+  if (super.journal_len > 0 && !use_mmap) {
+    jnl_active = 1;
+    jnl_limit = super.journal_len - 3 < JNL_MAX ? super.journal_len - 3 : JNL_MAX;
+    if (jnl_limit > bc_nframes / 2) jnl_limit = bc_nframes / 2;
+    dirty_cap = jnl_limit;
+  } else if (super.journal_len > 0) {
+    fprintf(stderr, "journal not used in mmap mode\n");
+  }
+  if (lfs_active) dirty_cap = bc_nframes / 2;
+  if (dirty_cap > 0 && dirty_cap < req_blocks(MFS_CREAT, 0, 0, NULL, 0))
+    fprintf(stderr, "only %d blocks may be dirty between commits, too few for creat (%d)\n",
+      dirty_cap, req_blocks(MFS_CREAT, 0, 0, NULL, 0));
+  if (meta_load() < 0) exit(1);
+  bm_init(&ialloc, ibitmap, super.num_inodes);
+  bm_init(&dalloc, dbitmap, super.data_region_len);
+  if (lfs_active && lfs_load() < 0) exit(1);
+  if (dindex_init() < 0) exit(1);
+  last_flush = time(NULL);
+  signal(SIGUSR1, on_sigusr1);
+
+  debug("Read super block. Inode rgn addr: %d, #inodes: %d\n", 
+    super.inode_region_addr, super.num_inodes);
+  inode_dbg(0);
+	
+  return 0;
+}
+
+/* ilock: the lock guarding inum */
+pthread_rwlock_t *ilock(int inum) {
+  return &ilocks[(unsigned int) inum % ILOCKS];
+}
+
+/* inval_note: log that inum changed; call once the change is made */
+void inval_note(int inum) {
+  pthread_mutex_lock(&inval_lock);
+  inval_seq++;
+  inval_log[inval_seq % INVAL_LOG] = inum;
+  pthread_mutex_unlock(&inval_lock);
+}
+
+/* inval_epoch: number of the last logged change */
+unsigned int inval_epoch() {
+  pthread_mutex_lock(&inval_lock);
+  unsigned int e = inval_seq;
+  pthread_mutex_unlock(&inval_lock);
+  return e;
+}
+
+/*
+inval_list: the inodes changed after epoch since, up to upto, into list
+returns: how many, -1 if the client must drop everything instead
+*/
+int inval_list(unsigned int since, unsigned int upto, int *list) {
+  int n = (int) (upto - since);
+  if (n == 0) return 0;
+  pthread_mutex_lock(&inval_lock);
+  if (n < 0 || n > WIRE_INVAL_MAX || inval_seq - since >= INVAL_LOG) n = -1;
+  for (int i = 0; i < n; i++) list[i] = inval_log[(since + 1 + i) % INVAL_LOG];
+  pthread_mutex_unlock(&inval_lock);
+  return n;
+}
+
+/*
+inval_attach: grant the lease on an encoded lookup, path or stat reply and
+piggyback the inodes changed after the client's epoch since, up to upto
+(taken before the request ran, so later changes are reported next time).
+Too long a list, or an epoch from before a restart, tells the client to
+drop everything instead.
+*/
+void inval_attach(held_t *out, unsigned int since, unsigned int upto) {
+  wire_hdr_t *h = (wire_hdr_t *) out->data;
+  h->epoch = upto;
+  h->lease = lease_ms;
+  int n = inval_list(since, upto, (int *) (out->data + out->len));
+  if (n < 0) h->flags |= WIRE_FLUSH;
+  if (n > 0) {
+    h->flags |= WIRE_INVAL;
+    h->len += n * sizeof(int);
+    out->len += n * sizeof(int);
+  }
+}
+
+/*
+lookup_path: resolve a path of len bytes (with its NUL) one component at a
+time, from inum or from the root for an absolute path; empty components are
+skipped. Each component's inode and stat go into comp, *ncomp of them.
+returns: inum of the last component, -1 if one is missing or the path is malformed
+*/
+int lookup_path(int inum, char *path, int len, wire_comp_t *comp, int *ncomp) {
+  *ncomp = 0;
+  if (len < 1 || len > MFS_BLOCK_SIZE || memchr(path, '\0', len) == NULL) return -1;
+  if (path[0] == '/') inum = 0;
+  char *p = path;
+  while (*p != '\0') {
+    if (*p == '/') {
+      p++;
+      continue;
+    }
+    int n = strcspn(p, "/");
+    if (n > 27 || *ncomp == WIRE_PATH_MAX) return -1;
+    char name[28];
+    memcpy(name, p, n);
+    name[n] = '\0';
+    p += n;
+
+    unsigned int addr;
+    pthread_rwlock_rdlock(ilock(inum));
+    dir_ent_t *de = lookup_file(inum, name, &addr);
+    pthread_rwlock_unlock(ilock(inum));
+    if (de == NULL) return -1;
+    inum = de->inum;
+    free(de);
+    inode_t ind;
+    pthread_rwlock_rdlock(ilock(inum));
+    int ok = read_inode(inum, &ind);
+    pthread_rwlock_unlock(ilock(inum));
+    if (ok < 0) return -1;
+    comp[*ncomp].inum = inum;
+    comp[*ncomp].type = is_dir(ind.type) ? MFS_DIRECTORY : ind.type;
+    comp[*ncomp].size = ind.size;
+    (*ncomp)++;
+  }
+  return inum;
+}
+
+/*
+unlink_locked: unlink_file with the parent and the child write-locked
+The child is only known after a lookup, so the locks are taken in stripe
+order afterwards and the lookup is repeated to see the name did not change.
+*/
+int unlink_locked(int pinum, char *name) {
+  while (1) {
+    unsigned int addr;
+    pthread_rwlock_rdlock(ilock(pinum));
+    dir_ent_t *de = lookup_file(pinum, name, &addr);
+    pthread_rwlock_unlock(ilock(pinum));
+    if (de == NULL) return -1;
+    int cinum = de->inum;
+    free(de);
+
+    pthread_rwlock_t *a = ilock(pinum), *b = ilock(cinum);
+    if (a > b) {
+      pthread_rwlock_t *t = a;
+      a = b;
+      b = t;
+    }
+    pthread_rwlock_wrlock(a);
+    if (b != a) pthread_rwlock_wrlock(b);
+    de = lookup_file(pinum, name, &addr);
+    int same = de != NULL && de->inum == cinum;
+    free(de);
+    int rc = same ? unlink_file(pinum, name) : 0;
+    if (b != a) pthread_rwlock_unlock(b);
+    pthread_rwlock_unlock(a);
+    if (same && rc == 0) inval_note(cinum);
+    if (same) return rc;
+  }
+}
+
+int run_compound(message_t *req, message_t *rep);
+
+/*
+handle_request: run one MFS operation and fill in the reply
+Takes the inode locks the operation needs; the caller holds fs_lock shared.
+returns: 1 if the operation may have modified the image, 0 if not,
+    -1 for an unknown operation
+*/
+int handle_request(message_t *req, message_t *rep) {
+  int rc = 0;
+  rep->msg = MFS_FEEDBACK;
+
+  if(req->msg == MFS_LOOKUP){
+    /*
+      - Get parent inum, file name from message.
+      - Lookup file and get entry address (call lookupFile)
+      - If found: 
+          - Read entry address into dir_ent_t struct
+          - Return inum
+      - Else throw err
+      */
+    unsigned int addr;
+    pthread_rwlock_rdlock(ilock(req->node_num));
+    dir_ent_t *de = lookup_file(req->node_num, req->name, &addr);
+    pthread_rwlock_unlock(ilock(req->node_num));
+    if (de != NULL) {
+      rep->node_num = de->inum;
+      free(de);
+    } else {
+      rep->node_num = -1;
+    }
+  }
+  else if(req->msg == MFS_LOOKUP_PATH){
+    int n;
+    rep->node_num = lookup_path(req->node_num, req->buf, req->nbytes, (wire_comp_t *) rep->buf, &n);
+    rep->nbytes = rep->node_num == -1 ? 0 : n * sizeof(wire_comp_t);
+  }
+  else if(req->msg == MFS_STAT){
+      /*
+      - Get inum from message
+      - Get inode from inum (call getInode)
+      - Return MFS-Stat struct with type and size of inode
+      */
+    inode_t ind;
+    pthread_rwlock_rdlock(ilock(req->node_num));
+    if (read_inode(req->node_num, &ind) == 0) {
+      rep->node_num = 0;
+      rep->st.size = ind.size;
+      rep->st.type = is_dir(ind.type) ? MFS_DIRECTORY : ind.type;
+    } 
+    else rep->node_num = -1;
+    pthread_rwlock_unlock(ilock(req->node_num));
+  }
+  else if((req->msg == MFS_WRITE || req->msg == MFS_READ)
+      && (req->nbytes < 0 || req->nbytes > MFS_BLOCK_SIZE)) {
+    rep->node_num = -1;
+  }
+  else if(req->msg == MFS_WRITE){
+    pthread_rwlock_wrlock(ilock(req->node_num));
+    rep->node_num = write_file(req->node_num, req->buf, 
+      req->offset, req->nbytes, UFS_REGULAR_FILE);
+    pthread_rwlock_unlock(ilock(req->node_num));
+    if (rep->node_num == 0) inval_note(req->node_num);
+    rc = 1;
+  }
+  else if(req->msg == MFS_READ){
+    pthread_rwlock_rdlock(ilock(req->node_num));
+    rep->node_num = read_file(req->node_num, rep->buf, req->offset, req->nbytes);
+    pthread_rwlock_unlock(ilock(req->node_num));
+  }
+  else if(req->msg == MFS_CREAT){
+    pthread_rwlock_wrlock(ilock(req->node_num));
+    rep->node_num = creat_file(req->node_num, req->mtype, req->name);
+    pthread_rwlock_unlock(ilock(req->node_num));
+    if (rep->node_num == 0) inval_note(req->node_num);
+    rc = 1;
+  }
+  else if(req->msg == MFS_UNLINK){
+    rep->node_num = unlink_locked(req->node_num, req->name);
+    if (rep->node_num == 0) inval_note(req->node_num);
+    rc = 1;
+  }
+  else if(req->msg == MFS_COMPOUND){
+    rc = run_compound(req, rep);
+  }
+  else if(req->msg == MFS_SHUTDOWN || req->msg == MFS_FEEDBACK) {
+    /* nothing to do; MFS_SHUTDOWN is finished by the caller after replying */
+  }
+  else {
+    return -1;
+  }
+  return rc;
+}
+
+/*
+run_compound: run the sub-operations of a MFS_COMPOUND request in order,
+each through handle_request, until one fails or is malformed
+An operation naming an earlier one in ref acts on the inode that one looked
+up, created or acted on. With a journal or log, the run also stops before
+an operation that would take the request past dirty_cap (see req_blocks).
+Results go into rep->buf, rep->nbytes of them.
+returns: 1 if any operation may have modified the image, 0 if not
+*/
+int run_compound(message_t *req, message_t *rep) {
+  int len = req->nbytes < 0 ? 0 : req->nbytes > MFS_BLOCK_SIZE ? MFS_BLOCK_SIZE : req->nbytes;
+  int inums[WIRE_OPS_MAX];
+  int rc = 0, nops = 0, in = 0, out = 0, ok = 0;
+  message_t *sub = (message_t *) malloc(sizeof(message_t));
+  message_t *res = (message_t *) malloc(sizeof(message_t));
+
+  while (1) {
+    if (in == len) {
+      ok = 1;
+      break;
+    }
+    wire_op_t o;
+    wire_res_t r;
+    if (nops == WIRE_OPS_MAX || in + (int) sizeof(o) > len) break;
+    memcpy(&o, req->buf + in, sizeof(o));
+    in += sizeof(o);
+    if (o.len > len - in) break;
+    int names = o.op == MFS_LOOKUP || o.op == MFS_CREAT || o.op == MFS_UNLINK;
+    if (!names && o.op != MFS_STAT && o.op != MFS_READ && o.op != MFS_WRITE) break;
+    if (names && (o.len == 0 || o.len > sizeof(sub->name))) break;
+    if (o.op == MFS_WRITE && o.len != o.nbytes) break;
+    if (o.op == MFS_READ && (o.nbytes < 0 || out + sizeof(r) + o.nbytes > MFS_BLOCK_SIZE)) break;
+    if (out + sizeof(r) > MFS_BLOCK_SIZE || o.ref >= nops) break;
+    if (dirty_cap > 0 && req_blocks(MFS_COMPOUND, 0, req->nbytes, req->buf, nops + 1) > dirty_cap) break;
+
+    sub->msg = o.op;
+    sub->node_num = o.ref >= 0 ? inums[o.ref] : o.inum;
+    sub->offset = o.offset;
+    sub->nbytes = o.nbytes;
+    sub->mtype = o.arg;
+    if (names) {
+      memcpy(sub->name, req->buf + in, o.len);
+      sub->name[o.len - 1] = '\0';
+    } else if (o.op == MFS_WRITE) {
+      memcpy(sub->buf, req->buf + in, o.len);
+    }
+    in += o.len;
+    rc |= handle_request(sub, res);
+
+    r.rc = res->node_num;
+    r.inum = sub->node_num;
+    r.type = res->st.type;
+    r.size = res->st.size;
+    r.len = 0;
+    if (o.op == MFS_LOOKUP) {
+      r.inum = res->node_num;
+    } else if (o.op == MFS_CREAT && res->node_num == 0) {
+      unsigned int addr;
+      pthread_rwlock_rdlock(ilock(sub->node_num));
+      dir_ent_t *de = lookup_file(sub->node_num, sub->name, &addr);
+      pthread_rwlock_unlock(ilock(sub->node_num));
+      r.inum = de != NULL ? de->inum : -1;
+      free(de);
+    } else if (o.op == MFS_READ && res->node_num == 0) {
+      r.len = o.nbytes;
+      memcpy(rep->buf + out + sizeof(r), res->buf, r.len);
+    }
+    memcpy(rep->buf + out, &r, sizeof(r));
+    out += sizeof(r) + r.len;
+    inums[nops++] = r.inum;
+    if (r.rc == -1 || r.inum == -1) break;
+  }
+  rep->node_num = ok ? 0 : -1;
+  rep->nbytes = out;
+  free(sub);
+  free(res);
+  __sync_fetch_and_add(&compounds, 1);
+  __sync_fetch_and_add(&compound_ops, nops);
+  return rc;
+}
+
+/*
+batch_recv: receive up to max waiting datagrams with one recvmmsg
+Each lands in its own message_t sized slot of raw, its length in lens.
+Blocks for the first one unless the socket is non-blocking or MSG_DONTWAIT
+is passed in flags.
+returns: number received, -1 if none
+*/
+int batch_recv(int sd, message_t *raw, int *lens, struct sockaddr_in *from, int max, int flags) {
+  struct mmsghdr mm[max];
+  struct iovec iov[max];
+  memset(mm, 0, sizeof(mm));
+  for (int i = 0; i < max; i++) {
+    iov[i].iov_base = &raw[i];
+    iov[i].iov_len = sizeof(message_t);
+    mm[i].msg_hdr.msg_name = &from[i];
+    mm[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    mm[i].msg_hdr.msg_iov = &iov[i];
+    mm[i].msg_hdr.msg_iovlen = 1;
+  }
+  int n = recvmmsg(sd, mm, max, flags, NULL);
+  if (n < 1) return -1;
+  for (int i = 0; i < n; i++) lens[i] = mm[i].msg_len;
+  int b = 31 - __builtin_clz(n);
+  __sync_fetch_and_add(&batch_hist[b < BATCH_BUCKETS ? b : BATCH_BUCKETS - 1], 1);
+  __sync_fetch_and_add(&batch_msgs, n);
+  return n;
+}
+
+/* sock_bufs: enlarge sd's buffers (up to the system limit) for bursts of fragments */
+void sock_bufs(int sd) {
+  int size = SOCK_BUF;
+  setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+/* sd_stream: is sd a TCP connection rather than a UDP socket? */
+int sd_stream(int sd) {
+  return tcp_fd != NULL && sd < tcp_nfd && tcp_fd[sd];
+}
+
+/*
+stream_write: write all of n iovecs (advanced as they go) to TCP connection sd
+A connection that fails or stalls for TCP_SEND_SECS is shut down, which ends
+its tcp_conn thread.
+returns: 0, or -1 if the connection failed
+*/
+int stream_write(int sd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t rc = writev(sd, iov, n);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      shutdown(sd, SHUT_RDWR);
+      return -1;
+    }
+    while (n > 0 && (size_t) rc >= iov->iov_len) {
+      rc -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + rc;
+      iov->iov_len -= rc;
+    }
+  }
+  return 0;
+}
+
+/* stream_read: read exactly n bytes from TCP connection sd
+returns: 0, or -1 once the client hung up */
+int stream_read(int sd, void *buf, int n) {
+  for (int done = 0; done < n; ) {
+    ssize_t rc = recv(sd, (char *) buf + done, n - done, MSG_WAITALL);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) return -1;
+    done += rc;
+  }
+  return 0;
+}
+
+/* frame_send: send one datagram of len bytes as a frame on TCP connection sd */
+int frame_send(int sd, char *data, int len) {
+  unsigned int pre = htonl(len);
+  struct iovec v[2];
+  v[0].iov_base = &pre;
+  v[0].iov_len = sizeof(pre);
+  v[1].iov_base = data;
+  v[1].iov_len = len;
+  return stream_write(sd, v, 2);
+}
+
+/* batch_send: send every reply in h with as few sendmmsg calls as possible,
+or one frame each on a TCP connection */
+void batch_send(int sd, held_t *h, int n) {
+  struct mmsghdr mm[GROUP_MAX];
+  struct iovec iov[GROUP_MAX];
+  if (sd_stream(sd)) {
+    for (int i = 0; i < n; i++) frame_send(sd, h[i].data, h[i].len);
+    return;
+  }
+  while (n > 0) {
+    int k = n < GROUP_MAX ? n : GROUP_MAX;
+    memset(mm, 0, k * sizeof(struct mmsghdr));
+    for (int i = 0; i < k; i++) {
+      iov[i].iov_base = h[i].data;
+      iov[i].iov_len = h[i].len;
+      mm[i].msg_hdr.msg_name = &h[i].addr;
+      mm[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      mm[i].msg_hdr.msg_iov = &iov[i];
+      mm[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = sendmmsg(sd, mm, k, 0);
+    if (sent < 1) {
+      if (sent < 0 && errno == EINTR) continue;
+      perror("batch_send: sendmmsg");
+      return;
+    }
+    h += sent;
+    n -= sent;
+  }
+}
+
+/* request_pending: is another datagram already waiting on sd? */
+int request_pending(int sd) {
+  fd_set set;
+  FD_ZERO(&set);
+  FD_SET(sd, &set);
+  struct timeval tv = { 0, 0 };
+  return select(sd + 1, &set, NULL, NULL, &tv) > 0;
+}
+
+void commit_wait();
+
+/*
+release_held: group commit. One journal commit (and fsync) covers every
+operation whose reply is held, then all of those replies go out. The commit
+goes through commit_wait, so it also advances durable_seq for TCP
+connection threads (-T) waiting on one.
+*/
+void release_held(int sd) {
+  commit_wait();
+  batch_send(sd, held, nheld);
+  nheld = 0;
+}
+
+/* drc_key: hash chain for a sender and request id */
+int drc_key(struct sockaddr_in *s, unsigned int reqid) {
+  unsigned int h = s->sin_addr.s_addr * 2654435761u ^ s->sin_port * 40503u ^ reqid * 2246822519u;
+  return (h ^ h >> 15) & (DRC_SIZE - 1);
+}
+
+/* drc_find: entry for a sender and request id, -1 if none; drc_lock held */
+int drc_find(struct sockaddr_in *s, unsigned int reqid) {
+  for (int i = drc_hash[drc_key(s, reqid)]; i != -1; i = drc[i].hnext)
+    if (drc[i].reqid == reqid && drc[i].addr.sin_port == s->sin_port
+        && drc[i].addr.sin_addr.s_addr == s->sin_addr.s_addr)
+      return i;
+  return -1;
+}
+
+/*
+drc_begin: look a mutating request up before running it
+A request seen for the first time is entered as running when create is set.
+returns: DRC_NEW to run it, DRC_BUSY if it is still running (drop the
+duplicate), DRC_DONE with the earlier reply copied into out
+*/
+int drc_begin(struct sockaddr_in *s, unsigned int reqid, int create, held_t *out) {
+  pthread_mutex_lock(&drc_lock);
+  if (drc == NULL) {
+    drc = (drc_t *) calloc(DRC_SIZE, sizeof(drc_t));
+    drc_hash = (int *) malloc(DRC_SIZE * sizeof(int));
+    for (int i = 0; i < DRC_SIZE; i++) drc_hash[i] = -1;
+  }
+  int i = drc_find(s, reqid);
+  int state = i == -1 ? DRC_NEW : drc[i].state;
+  if (state == DRC_DONE) {
+    out->addr = *s;
+    out->len = drc[i].len;
+    memcpy(out->data, drc[i].rep, drc[i].len);
+    drc_replayed++;
+  } else if (state == DRC_BUSY) {
+    drc_dropped++;
+  } else if (create) {
+    /* reuse the oldest entry */
+    i = drc_clock;
+    drc_clock = (drc_clock + 1) & (DRC_SIZE - 1);
+    if (drc[i].state != DRC_NEW) {
+      int *pp = &drc_hash[drc_key(&drc[i].addr, drc[i].reqid)];
+      while (*pp != i) pp = &drc[*pp].hnext;
+      *pp = drc[i].hnext;
+    }
+    drc[i].addr = *s;
+    drc[i].reqid = reqid;
+    drc[i].state = DRC_BUSY;
+    int h = drc_key(s, reqid);
+    drc[i].hnext = drc_hash[h];
+    drc_hash[h] = i;
+  }
+  pthread_mutex_unlock(&drc_lock);
+  return state;
+}
+
+/* drc_end: record the reply to a request drc_begin entered, or forget it if out is NULL */
+void drc_end(struct sockaddr_in *s, unsigned int reqid, held_t *out) {
+  pthread_mutex_lock(&drc_lock);
+  int i = drc_find(s, reqid);
+  if (i != -1 && drc[i].state == DRC_BUSY) {
+    char *rep = out != NULL ? (char *) realloc(drc[i].rep, out->len) : NULL;
+    if (rep != NULL) {
+      drc[i].rep = rep;
+      drc[i].len = out->len;
+      memcpy(drc[i].rep, out->data, out->len);
+      drc[i].state = DRC_DONE;
+    } else {
+      int *pp = &drc_hash[drc_key(s, reqid)];
+      while (*pp != i) pp = &drc[*pp].hnext;
+      *pp = drc[i].hnext;
+      drc[i].state = DRC_NEW;
+    }
+  }
+  pthread_mutex_unlock(&drc_lock);
+}
+
+/*
+frag_add: file one MFS_WRITE_RANGE fragment from s under its request id
+Entries abandoned by their client for FRAG_SECS are dropped on the way.
+returns: the write, unlinked, once its last fragment is in; otherwise NULL
+*/
+frag_t *frag_add(struct sockaddr_in *s, unsigned int reqid, message_t *req) {
+  int start = req->st.size, len = req->mtype;
+  int k = (req->offset - start) / MFS_BLOCK_SIZE;
+  if (len < 1 || len > WIRE_RANGE_MAX || req->offset < start
+      || (req->offset - start) % MFS_BLOCK_SIZE != 0 || req->offset - start >= len
+      || req->nbytes != (len - k * MFS_BLOCK_SIZE < MFS_BLOCK_SIZE ? len - k * MFS_BLOCK_SIZE : MFS_BLOCK_SIZE))
+    return NULL;
+
+  time_t now = time(NULL);
+  frag_t *f = NULL, *done = NULL;
+  pthread_mutex_lock(&frag_lock);
+  for (frag_t **pp = &frags; *pp != NULL; ) {
+    frag_t *e = *pp;
+    if (e->reqid == reqid && e->addr.sin_port == s->sin_port
+        && e->addr.sin_addr.s_addr == s->sin_addr.s_addr) {
+      f = e;
+    } else if (now - e->born > FRAG_SECS) {
+      *pp = e->next;
+      free(e->data);
+      free(e);
+      continue;
+    }
+    pp = &e->next;
+  }
+  if (f != NULL && (f->inum != req->node_num || f->start != start || f->len != len)) f = NULL;
+  if (f == NULL) {
+    f = (frag_t *) calloc(1, sizeof(frag_t));
+    if (f == NULL || (f->data = (char *) malloc(len)) == NULL) {
+      free(f);
+      pthread_mutex_unlock(&frag_lock);
+      perror("frag_add: out of memory");
+      return NULL;
+    }
+    f->addr = *s;
+    f->reqid = reqid;
+    f->inum = req->node_num;
+    f->start = start;
+    f->len = len;
+    f->nfrags = (len + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+    f->born = now;
+    f->next = frags;
+    frags = f;
+  }
+  if (!f->have[k]) {
+    f->have[k] = 1;
+    f->got++;
+    memcpy(f->data + k * MFS_BLOCK_SIZE, req->buf, req->nbytes);
+  }
+  if (f->got == f->nfrags) {
+    for (frag_t **pp = &frags; *pp != NULL; pp = &(*pp)->next)
+      if (*pp == f) {
+        *pp = f->next;
+        break;
+      }
+    done = f;
+  }
+  pthread_mutex_unlock(&frag_lock);
+  return done;
+}
+
+/*
+read_iov: point iovecs at bytes [offset, offset + nbytes) of the file with
+inode nd, without copying them: at the cache frame or mapping of blocks in
+memory (pinned into pins, for blkput once sent), or at a copy read from
+disk into the next of the cap blocks of *bounce (allocated on first use,
+*nbounce of them used). Called with the inode locked, so the data cannot
+change before it is sent.
+returns: number of iovecs (at most 2 for up to a block), -1 if the range is
+not readable
+*/
+int read_iov(inode_t *nd, int offset, int nbytes, struct iovec *iov, char **pins, int *npins,
+    char **bounce, int *nbounce, int cap) {
+  if (offset < 0 || nbytes < 0 || offset / UFS_BLOCK_SIZE > DIRECT_PTRS - 1) return -1;
+  int n = 0;
+  for (int done = 0; done < nbytes; n++) {
+    int b = (offset + done) / UFS_BLOCK_SIZE;
+    if (b > DIRECT_PTRS - 1 || nd->direct[b] == -1) return -1;
+    int off = (offset + done) % UFS_BLOCK_SIZE;
+    int len = UFS_BLOCK_SIZE - off < nbytes - done ? UFS_BLOCK_SIZE - off : nbytes - done;
+    char *p = blkpin(nd->direct[b]);
+    if (p != NULL) {
+      pins[(*npins)++] = p;
+      __sync_fetch_and_add(&zc_pinned, 1);
+    } else {
+      if (*bounce == NULL) *bounce = (char *) malloc((size_t) cap * UFS_BLOCK_SIZE);
+      p = *bounce + (size_t) (*nbounce)++ * UFS_BLOCK_SIZE;
+      disk_read(nd->direct[b], p);
+      __sync_fetch_and_add(&zc_bounced, 1);
+    }
+    iov[n].iov_base = p + off;
+    iov[n].iov_len = len;
+    done += len;
+  }
+  return n;
+}
+
+/* readable: can bytes [offset, offset + nbytes) of the file with inode nd be read? */
+int readable(inode_t *nd, int offset, int nbytes) {
+  if (offset < 0 || nbytes < 0 || offset / UFS_BLOCK_SIZE > DIRECT_PTRS - 1) return 0;
+  for (int b = offset / UFS_BLOCK_SIZE; nbytes > 0 && b <= (offset + nbytes - 1) / UFS_BLOCK_SIZE; b++)
+    if (b > DIRECT_PTRS - 1 || nd->direct[b] == -1) return 0;
+  return 1;
+}
+
+/*
+stream_part: send n bytes, from memory at p or else from the image at byte
+from, on TCP connection sd, made non-blocking by the caller
+What the socket does not take right away is appended to *tail (allocated
+to cap bytes when it starts), and once a tail has started so is everything
+after it, to keep the frame in order.
+returns: 0, or -1 if the connection failed
+*/
+int stream_part(int sd, char *p, off_t from, int n, char **tail, int *ntail, int cap) {
+  while (n > 0 && *tail == NULL) {
+    ssize_t rc = p != NULL ? send(sd, p, n, 0) : sendfile(sd, fd, &from, n);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      *tail = (char *) malloc(cap);
+      if (*tail != NULL) break;
+    }
+    if (rc <= 0) {
+      shutdown(sd, SHUT_RDWR);
+      return -1;
+    }
+    if (p != NULL) p += rc;
+    n -= rc;
+  }
+  if (n == 0) return 0;
+  if (p != NULL) {
+    memcpy(*tail + *ntail, p, n);
+  } else if (pread(fd, *tail + *ntail, n, from) != n) {
+    shutdown(sd, SHUT_RDWR);
+    return -1;
+  }
+  *ntail += n;
   return 0;
 }
 
+/*
+stream_file: send header h and bytes [offset, offset + len) of the file with
+inode nd as one frame on TCP connection sd
+Blocks in memory are written from their cache frame or mapping. Runs of
+blocks that are not, and lie next to each other on disk, go from the image
+to the socket with one sendfile each, never passing through user space.
+The frame is corked so it leaves in full segments. Called with the inode
+read locked and the range known to be readable, so nothing here waits on
+the client: once the socket is full, the rest of the frame is copied into
+*tail, *ntail bytes, for stream_tail to send after the locks are dropped.
+returns: 0, or -1 if the connection failed
+*/
+int stream_file(int sd, inode_t *nd, wire_hdr_t *h, int offset, int len, char **tail, int *ntail) {
+  char head[sizeof(unsigned int) + sizeof(wire_hdr_t)];
+  unsigned int pre = htonl(sizeof(wire_hdr_t) + len);
+  memcpy(head, &pre, sizeof(pre));
+  memcpy(head + sizeof(pre), h, sizeof(wire_hdr_t));
+  int cap = sizeof(head) + len;
+  *tail = NULL;
+  *ntail = 0;
+  int flags = fcntl(sd, F_GETFL);
+  fcntl(sd, F_SETFL, flags | O_NONBLOCK);
+  int on = 1, off = 0;
+  setsockopt(sd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+  int rc = stream_part(sd, head, 0, sizeof(head), tail, ntail, cap);
+  off_t from = 0;
+  int run = 0;
+  for (int done = 0; rc == 0 && done < len; ) {
+    int b = (offset + done) / UFS_BLOCK_SIZE;
+    int at = (offset + done) % UFS_BLOCK_SIZE;
+    int n = UFS_BLOCK_SIZE - at < len - done ? UFS_BLOCK_SIZE - at : len - done;
+    char *p = blkpin(nd->direct[b]);
+    if (p != NULL) {
+      if (run > 0) rc = stream_part(sd, NULL, from, run, tail, ntail, cap);
+      run = 0;
+      if (rc == 0) rc = stream_part(sd, p + at, 0, n, tail, ntail, cap);
+      blkput(p);
+      __sync_fetch_and_add(&zc_pinned, 1);
+    } else {
+      /* not in memory, so the image holds its latest contents */
+      off_t pos = (off_t) nd->direct[b] * UFS_BLOCK_SIZE + at;
+      if (run > 0 && pos != from + run) {
+        rc = stream_part(sd, NULL, from, run, tail, ntail, cap);
+        run = 0;
+      }
+      if (run == 0) from = pos;
+      run += n;
+      __sync_fetch_and_add(&zc_spliced, 1);
+    }
+    done += n;
+  }
+  if (rc == 0 && run > 0) rc = stream_part(sd, NULL, from, run, tail, ntail, cap);
+  fcntl(sd, F_SETFL, flags);
+  if (*tail == NULL) setsockopt(sd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+  return rc;
+}
+
+/* stream_tail: send, unlocked, the part of a frame stream_file left in tail, and free it */
+void stream_tail(int sd, char *tail, int ntail) {
+  if (tail == NULL) return;
+  struct iovec v = { tail, ntail };
+  if (stream_write(sd, &v, 1) == 0) __sync_fetch_and_add(&tcp_deferred, 1);
+  int off = 0;
+  setsockopt(sd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+  free(tail);
+}
+
+/*
+send_file: answer an MFS_READ or MFS_READ_RANGE on sd right away
+Each reply datagram is a header followed by iovecs pointing at the file's
+blocks (see read_iov), so the data is copied only by the kernel. A range
+goes out as one fragment per block, all with one sendmmsg, while the inode
+stays read locked. On a TCP connection the whole read is one frame instead
+(see stream_file); what the socket cannot take at once is sent after the
+locks are released.
+*/
+void send_file(int sd, struct sockaddr_in *s, unsigned int reqid, message_t *req) {
+  int range = req->msg == MFS_READ_RANGE;
+  int len = req->nbytes;
+  int ok = len >= 0 && len <= (range ? WIRE_RANGE_MAX : MFS_BLOCK_SIZE);
+  int n = !ok || len == 0 ? 1 : (len + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+  wire_hdr_t hdr[WIRE_WINDOW];
+  struct iovec iov[WIRE_WINDOW][3];
+  struct mmsghdr mm[WIRE_WINDOW];
+  char *pins[2 * WIRE_WINDOW];
+  char *bounce = NULL, *tail = NULL;
+  int npins = 0, nbounce = 0, ntail = 0;
+  message_t *m = (message_t *) malloc(sizeof(message_t));
+  memset(m, 0, sizeof(message_t));
+  memset(mm, 0, n * sizeof(struct mmsghdr));
+
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_rdlock(ilock(req->node_num));
+  inode_t nd;
+  if (ok && read_inode(req->node_num, &nd) < 0) ok = 0;
+  if (sd_stream(sd)) {
+    if (ok) ok = readable(&nd, req->offset, len);
+    m->node_num = ok ? 0 : -1;
+    m->offset = req->offset;
+    m->nbytes = ok ? len : range ? 0 : req->nbytes;
+    m->st.size = len;
+    wire_header(m, req->msg, reqid, WIRE_REPLY, &hdr[0]);
+    hdr[0].len = ok ? len : 0;
+    if (!range) hdr[0].lease = lease_ms;
+    stream_file(sd, &nd, &hdr[0], req->offset, ok ? len : 0, &tail, &ntail);
+    n = 0;
+  }
+  for (int i = 0; ok && i < n; i++) {
+    int flen = len - i * MFS_BLOCK_SIZE < MFS_BLOCK_SIZE ? len - i * MFS_BLOCK_SIZE : MFS_BLOCK_SIZE;
+    int k = read_iov(&nd, req->offset + i * MFS_BLOCK_SIZE, flen, &iov[i][1], pins, &npins,
+      &bounce, &nbounce, 2 * n);
+    if (k < 0) ok = 0;
+    m->offset = req->offset + i * MFS_BLOCK_SIZE;
+    m->nbytes = flen;
+    m->st.size = len;
+    wire_header(m, req->msg, reqid, WIRE_REPLY, &hdr[i]);
+    hdr[i].len = flen;
+    mm[i].msg_hdr.msg_iovlen = 1 + k;
+  }
+  if (!ok && n > 0) {
+    n = 1;
+    m->node_num = -1;
+    m->offset = req->offset;
+    m->nbytes = range ? 0 : req->nbytes;
+    m->st.size = len;
+    wire_header(m, req->msg, reqid, WIRE_REPLY, &hdr[0]);
+    mm[0].msg_hdr.msg_iovlen = 1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!range) hdr[i].lease = lease_ms;
+    iov[i][0].iov_base = &hdr[i];
+    iov[i][0].iov_len = sizeof(wire_hdr_t);
+    mm[i].msg_hdr.msg_name = s;
+    mm[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    mm[i].msg_hdr.msg_iov = iov[i];
+  }
+  for (int sent = 0; sent < n; ) {
+    int rc = sendmmsg(sd, mm + sent, n - sent, 0);
+    if (rc < 1) {
+      if (rc < 0 && errno == EINTR) continue;
+      perror("send_file: sendmmsg");
+      break;
+    }
+    sent += rc;
+  }
+  for (int i = 0; i < npins; i++) blkput(pins[i]);
+  pthread_rwlock_unlock(ilock(req->node_num));
+  pthread_rwlock_unlock(&fs_lock);
+  stream_tail(sd, tail, ntail);
+  if (range) __sync_fetch_and_add(&range_reads, 1);
+  free(bounce);
+  free(m);
+}
+
+/*
+list_dir: collect up to max live entries of directory inum from a cookie
+A linear directory is scanned block by block from slot pos, a B-tree one
+leaf by leaf from the first name after name. *next is the slot to resume
+from, -1 once the directory is exhausted. The caller holds inum's lock.
+returns: number of entries, -1 if inum is not a directory
+*/
+int list_dir(int inum, int pos, char *name, wire_dirent_t *ents, int max, int *next) {
+  inode_t nd;
+  if (read_inode(inum, &nd) < 0 || !is_dir(nd.type) || pos < 0) return -1;
+  int n = 0;
+  *next = -1;
+  if (nd.type == UFS_DIR_BTREE) {
+    int blk = nd.direct[0];
+    bt_node_t *b = (bt_node_t *) blkget(blk, 1, 0);
+    while (!b->leaf) {
+      blk = b->ents[bt_child(b, name)].inum;
+      blkput((char *) b);
+      b = (bt_node_t *) blkget(blk, 1, 0);
+    }
+    int i = bt_find(b, name);
+    if (i < b->nkeys && strcmp(b->ents[i].name, name) == 0) i++;
+    while (1) {
+      for (; i < b->nkeys && n < max; i++, n++) {
+        memcpy(ents[n].name, b->ents[i].name, sizeof(ents[n].name));
+        ents[n].inum = b->ents[i].inum;
+      }
+      if (n == max && (i < b->nkeys || b->next != -1)) *next = 0;
+      if (n == max || b->next == -1) break;
+      blk = b->next;
+      blkput((char *) b);
+      b = (bt_node_t *) blkget(blk, 1, 0);
+      i = 0;
+    }
+    blkput((char *) b);
+    return n;
+  }
+
+  int per = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  int slots = nd.size / sizeof(dir_ent_t);
+  for (int slot = pos; slot < slots; ) {
+    int end = (slot / per + 1) * per < slots ? (slot / per + 1) * per : slots;
+    dir_block_t *db = (dir_block_t *) blkget(nd.direct[slot / per], 1, 0);
+    for (; slot < end && n < max; slot++) {
+      dir_ent_t *e = &db->entries[slot % per];
+      if (e->inum == -1) continue;
+      memcpy(ents[n].name, e->name, sizeof(ents[n].name));
+      ents[n++].inum = e->inum;
+    }
+    blkput((char *) db);
+    if (n == max) {
+      if (slot < slots) *next = slot;
+      break;
+    }
+  }
+  return n;
+}
+
+/*
+read_dir: answer an MFS_READDIR on sd right away, like a range read
+The entries are collected under the directory's lock, then the children's
+inodes are looked up in one pass after it is released. The listing leads
+with the inodes changed since the client's epoch since, as far as the
+epoch before it was collected.
+*/
+void read_dir(int sd, struct sockaddr_in *s, unsigned int reqid, message_t *req, unsigned int since) {
+  int room = req->nbytes < (int) WIRE_DIRINVAL_MAX ? 0 : req->nbytes - WIRE_DIRINVAL_MAX;
+  int max = room / sizeof(wire_dirent_t);
+  if (max > (WIRE_RANGE_MAX - WIRE_DIRINVAL_MAX) / sizeof(wire_dirent_t))
+    max = (WIRE_RANGE_MAX - WIRE_DIRINVAL_MAX) / sizeof(wire_dirent_t);
+  char *buf = (char *) malloc(WIRE_DIRINVAL_MAX + max * sizeof(wire_dirent_t));
+  wire_inval_t *inv = (wire_inval_t *) buf;
+  inv->epoch = inval_epoch();
+  inv->n = inval_list(since, inv->epoch, (int *) (inv + 1));
+  int pre = sizeof(wire_inval_t) + (inv->n > 0 ? inv->n : 0) * sizeof(int);
+  wire_dirent_t *ents = (wire_dirent_t *) (buf + pre);
+  int next = -1;
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_rdlock(ilock(req->node_num));
+  int n = list_dir(req->node_num, req->offset, req->name, ents, max, &next);
+  pthread_rwlock_unlock(ilock(req->node_num));
+  for (int i = 0; i < n; i++) {
+    inode_t ind;
+    ents[i].type = -1;
+    ents[i].size = 0;
+    if (!req->mtype) continue;
+    pthread_rwlock_rdlock(ilock(ents[i].inum));
+    if (read_inode(ents[i].inum, &ind) == 0) {
+      ents[i].type = is_dir(ind.type) ? MFS_DIRECTORY : ind.type;
+      ents[i].size = ind.size;
+    }
+    pthread_rwlock_unlock(ilock(ents[i].inum));
+  }
+  pthread_rwlock_unlock(&fs_lock);
+
+  int len = n < 0 ? 0 : pre + n * sizeof(wire_dirent_t);
+  int nf = len == 0 ? 1 : (len + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+  held_t *h = (held_t *) malloc(nf * sizeof(held_t));
+  message_t *m = (message_t *) malloc(sizeof(message_t));
+  memset(m, 0, sizeof(message_t));
+  m->node_num = n < 0 ? -1 : 0;
+  m->st.size = len;
+  m->st.type = next;
+  for (int i = 0; i < nf; i++) {
+    m->offset = i * MFS_BLOCK_SIZE;
+    m->nbytes = len - i * MFS_BLOCK_SIZE < MFS_BLOCK_SIZE ? len - i * MFS_BLOCK_SIZE : MFS_BLOCK_SIZE;
+    memcpy(m->buf, buf + m->offset, m->nbytes);
+    h[i].addr = *s;
+    h[i].len = wire_encode(m, MFS_READDIR, reqid, WIRE_REPLY, h[i].data);
+    ((wire_hdr_t *) h[i].data)->lease = lease_ms;
+  }
+  batch_send(sd, h, nf);
+  __sync_fetch_and_add(&dir_lists, 1);
+  __sync_fetch_and_add(&dir_listed, n < 0 ? 0 : n);
+  free(m);
+  free(h);
+  free(buf);
+}
+
+/*
+write_range: perform an MFS_WRITE_RANGE once all its fragments are in
+returns: 1 with the reply encoded into out, -1 while fragments are missing
+*/
+int write_range(struct sockaddr_in *s, unsigned int reqid, message_t *req, held_t *out) {
+  frag_t *f = frag_add(s, reqid, req);
+  if (f == NULL) return -1;
+  if (drc_begin(s, reqid, 1, out) != DRC_NEW) {
+    free(f->data);
+    free(f);
+    return -1;
+  }
+  message_t *rep = (message_t *) malloc(sizeof(message_t));
+  memset(rep, 0, sizeof(message_t));
+  int need = req_blocks(MFS_WRITE_RANGE, f->start, f->len, NULL, 0);
+  if (dirty_reserve(need) < 0) {
+    rep->node_num = -1;
+  } else {
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(ilock(f->inum));
+    rep->node_num = write_file(f->inum, f->data, f->start, f->len, UFS_REGULAR_FILE);
+    pthread_rwlock_unlock(ilock(f->inum));
+    pthread_rwlock_unlock(&fs_lock);
+    dirty_release(need);
+  }
+  if (rep->node_num == 0) inval_note(f->inum);
+  rep->offset = f->start;
+  rep->nbytes = f->len;
+  out->addr = *s;
+  out->len = wire_encode(rep, MFS_WRITE_RANGE, reqid, WIRE_REPLY, out->data);
+  drc_end(s, reqid, out);
+  __sync_fetch_and_add(&range_writes, 1);
+  free(rep);
+  free(f->data);
+  free(f);
+  return 1;
+}
+
+/*
+serve_datagram: decode the request in a datagram of len bytes, run it and
+encode the reply into out, in the same format the request came in
+A MFS_SHUTDOWN request keeps the file system write locked, so nothing runs
+after it; the caller sends the reply and then calls end_serv. Reads and
+directory listings are answered right away on sd.
+returns: as handle_request, 2 for MFS_SHUTDOWN, -1 if there is no reply in
+out (not a valid request, a retransmission of one still running, a range
+write still missing fragments, or a read or listing already answered)
+*/
+int serve_datagram(int sd, char *raw, int len, struct sockaddr_in *s, held_t *out) {
+  message_t req, rep;
+  unsigned int reqid;
+  int flags;
+  int legacy = wire_decode(raw, len, &req, &reqid, &flags);
+  if (legacy < 0 || (flags & WIRE_REPLY)) {
+    fprintf(stderr, "dropping malformed datagram of %d bytes\n", len);
+    return -1;
+  }
+
+  /* retransmitted mutating requests are answered from the cache; the replay
+     is held for a commit like the original reply */
+  int cached = !legacy && (req.msg == MFS_WRITE || req.msg == MFS_CREAT
+    || req.msg == MFS_UNLINK || req.msg == MFS_WRITE_RANGE || req.msg == MFS_COMPOUND);
+  if (cached) {
+    int state = drc_begin(s, reqid, req.msg != MFS_WRITE_RANGE, out);
+    if (state == DRC_BUSY) return -1;
+    if (state == DRC_DONE) return 1;
+  }
+  if (!legacy && req.msg == MFS_WRITE_RANGE) return write_range(s, reqid, &req, out);
+  if (!legacy && (req.msg == MFS_READ || req.msg == MFS_READ_RANGE)) {
+    send_file(sd, s, reqid, &req);
+    return -1;
+  }
+  if (!legacy && req.msg == MFS_READDIR) {
+    read_dir(sd, s, reqid, &req, ((wire_hdr_t *) raw)->epoch);
+    return -1;
+  }
+
+  unsigned int epoch = inval_epoch();
+  int rc;
+  /* a compound that does not fit whole runs until its budget is spent */
+  int need = req_blocks(req.msg, req.offset, req.nbytes, req.buf, WIRE_OPS_MAX);
+  if (need > dirty_cap && req.msg == MFS_COMPOUND) need = dirty_cap;
+  if (req.msg == MFS_SHUTDOWN) {
+    pthread_rwlock_wrlock(&fs_lock);
+    rc = handle_request(&req, &rep) < 0 ? -1 : 2;
+  } else if (dirty_reserve(need) < 0) {
+    memset(&rep, 0, sizeof(rep));
+    rep.msg = MFS_FEEDBACK;
+    rep.node_num = -1;
+    rc = 0;
+  } else {
+    pthread_rwlock_rdlock(&fs_lock);
+    rc = handle_request(&req, &rep);
+    pthread_rwlock_unlock(&fs_lock);
+    dirty_release(need);
+  }
+  if (rc < 0) {
+    fprintf(stderr, "invalid MFS function %d\n", req.msg);
+    return -1;
+  }
+
+  out->addr = *s;
+  if (legacy) {
+    memcpy(out->data, &rep, sizeof(message_t));
+    out->len = sizeof(message_t);
+  } else {
+    if (req.msg != MFS_LOOKUP_PATH && req.msg != MFS_COMPOUND) rep.nbytes = req.nbytes;
+    out->len = wire_encode(&rep, req.msg, reqid, WIRE_REPLY, out->data);
+    if (req.msg == MFS_LOOKUP || req.msg == MFS_STAT || req.msg == MFS_LOOKUP_PATH)
+      inval_attach(out, ((wire_hdr_t *) raw)->epoch, epoch);
+    else if (req.msg == MFS_READ)
+      ((wire_hdr_t *) out->data)->lease = lease_ms;
+  }
+  if (cached) drc_end(s, reqid, out);
+  return rc;
+}
+
 int run_udp(int port) { 
   int sd=-1;
   if((sd =   UDP_Open(port))< 0){
     perror("initialize_serv: port open fail");
     return -1;
   }
+  sock_bufs(sd);
 
-  struct sockaddr_in s;
-  message_t buf_pk,  rx_pk;
+  /* one batch of requests and the replies sent back right away */
+  message_t *raw = (message_t *) malloc(batch_max * sizeof(message_t));
+  int *lens = (int *) malloc(batch_max * sizeof(int));
+  struct sockaddr_in *from = (struct sockaddr_in *) malloc(batch_max * sizeof(struct sockaddr_in));
+  held_t *out = (held_t *) malloc(batch_max * sizeof(held_t));
 
   while (1) {
-    if( UDP_Read(sd, &s, (char *)&buf_pk, sizeof(message_t)) < 1)
+    fs_tick();
+    /* commit once the burst of requests has been drained */
+    if (nheld > 0 && !request_pending(sd)) release_held(sd);
+
+    /* wake up at least once per flush interval so idle dirty blocks reach disk */
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(sd, &set);
+    struct timeval tv;
+    tv.tv_sec = flush_secs > 0 ? flush_secs : 1;
+    tv.tv_usec = 0;
+    if (select(sd + 1, &set, NULL, NULL, &tv) <= 0)
       continue;
 
+    int n = batch_recv(sd, raw, lens, from, batch_max, MSG_DONTWAIT);
+    if (n < 1)
+      continue;
 
-    if(buf_pk.msg == MFS_LOOKUP){
-      /*
-        - Get parent inum, file name from message.
-        - Lookup file and get entry address (call lookupFile)
-        - If found: 
-            - Read entry address into dir_ent_t struct
-            - Return inum
-        - Else throw err
+    int nout = 0;
+    for (int i = 0; i < n; i++) {
+      int rc = serve_datagram(sd, (char *) &raw[i], lens[i], &from[i], &out[nout]);
+      if (rc < 0)
+        continue;
+
+      if (rc == 2) {
+       /*
+        - Write any remaining data to image
+        - Break from loop
         */
-      unsigned int addr;
-      dir_ent_t *de = lookup_file(buf_pk.node_num, buf_pk.name, &addr);
-      if (de != NULL) {
-        rx_pk.node_num = de->inum;
+        fs_flush();
+        batch_send(sd, held, nheld);
+        batch_send(sd, out, nout + 1);
+        end_serv();
+      }
+
+      if (rc == 1 && jnl_active) {
+        held[nheld++] = out[nout];
+        if (nheld == GROUP_MAX || ndirty >= jnl_limit) release_held(sd);
       } else {
-        rx_pk.node_num = -1;
+        nout++;
       }
-      rx_pk.msg = MFS_FEEDBACK;
-      UDP_Write(sd, &s, (char*)&rx_pk, sizeof(message_t));
-    }
-    else if(buf_pk.msg == MFS_STAT){
-        /*
-        - Get inum from message
-        - Get inode from inum (call getInode)
-        - Return MFS-Stat struct with type and size of inode
-        */
-      inode_t *ind = (inode_t *) malloc(sizeof(inode_t));
-      read_inode(buf_pk.node_num, ind);
-      if (ind != NULL) {
-        rx_pk.node_num = 0;
-        rx_pk.st.size = ind->size;
-        rx_pk.st.type = ind->type;
-      } 
-      else rx_pk.node_num = -1;
-      rx_pk.msg = MFS_FEEDBACK;
-      UDP_Write(sd, &s, (char*)&rx_pk, sizeof(message_t));
+    }
+    batch_send(sd, out, nout);
+  }
+
+  return 0;
+}
 
+/*
+commit_wait: return once a journal commit covers the caller's last request
+The first waiter that finds no commit running flushes for every request
+finished so far, so requests completing together share one commit.
+*/
+void commit_wait() {
+  pthread_mutex_lock(&commit_lock);
+  unsigned long mine = ++op_seq;
+  while (durable_seq < mine) {
+    if (committing) {
+      pthread_cond_wait(&commit_cond, &commit_lock);
+      continue;
     }
-    else if(buf_pk.msg == MFS_WRITE){
-      rx_pk.node_num = write_file(buf_pk.node_num, buf_pk.buf, 
-        buf_pk.offset, buf_pk.nbytes, UFS_REGULAR_FILE);
-      rx_pk.msg = MFS_FEEDBACK;
-      UDP_Write(sd, &s, (char*)&rx_pk, sizeof(message_t));
+    committing = 1;
+    unsigned long target = op_seq;
+    pthread_mutex_unlock(&commit_lock);
+    pthread_rwlock_wrlock(&fs_lock);
+    fs_flush();
+    pthread_rwlock_unlock(&fs_lock);
+    pthread_mutex_lock(&commit_lock);
+    if (durable_seq < target) durable_seq = target;
+    committing = 0;
+    pthread_cond_broadcast(&commit_cond);
+  }
+  pthread_mutex_unlock(&commit_lock);
+}
 
+/* worker: one request thread of run_pool, all reading the same socket */
+void *worker(void *arg) {
+  int sd = *(int *) arg;
+  message_t *raw = (message_t *) malloc(sizeof(message_t));
+  held_t *out = (held_t *) malloc(sizeof(held_t));
+  struct sockaddr_in s;
+  while (1) {
+    int len = UDP_Read(sd, &s, (char *) raw, sizeof(message_t));
+    if (len < 1)
+      continue;
+    int rc = serve_datagram(sd, (char *) raw, len, &s, out);
+    if (rc < 0) continue;
+    if (rc == 2) {
+      fs_flush();
+      UDP_Write(sd, &out->addr, out->data, out->len);
+      end_serv();
     }
-    else if(buf_pk.msg == MFS_READ){
-      rx_pk.node_num = read_file(buf_pk.node_num, rx_pk.buf, buf_pk.offset, buf_pk.nbytes);
-      rx_pk.msg = MFS_FEEDBACK;
-      UDP_Write(sd, &s, (char*)&rx_pk, sizeof(message_t));
+    if (rc == 1 && jnl_active) commit_wait();
+    UDP_Write(sd, &out->addr, out->data, out->len);
+    fs_tick();
+  }
+  return NULL;
+}
 
+/*
+run_pool: serve requests with nthreads worker threads
+The main thread only runs the periodic flush.
+*/
+int run_pool(int port) {
+  static int sd;
+  if ((sd = UDP_Open(port)) < 0) {
+    perror("run_pool: port open fail");
+    return -1;
+  }
+  sock_bufs(sd);
+  for (int i = 0; i < nthreads; i++) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, worker, &sd) != 0) {
+      perror("run_pool: cannot start worker");
+      return -1;
     }
-    else if(buf_pk.msg == MFS_CREAT){
-      rx_pk.node_num = creat_file(buf_pk.node_num, buf_pk.mtype, buf_pk.name);
-      rx_pk.msg = MFS_FEEDBACK;
-      UDP_Write(sd, &s, (char*)&rx_pk, sizeof(message_t));
+    pthread_detach(t);
+  }
+  while (1) {
+    sleep(flush_secs > 0 ? flush_secs : 1);
+    fs_tick();
+  }
+  return 0;
+}
+
+/* shard_open: a non-blocking UDP socket sharing port with the other shards */
+int shard_open(int port) {
+  int sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sd < 0) return -1;
+  int one = 1;
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(port);
+  a.sin_addr.s_addr = INADDR_ANY;
+  if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0
+    || bind(sd, (struct sockaddr *) &a, sizeof(a)) < 0
+    || fcntl(sd, F_SETFL, O_NONBLOCK) < 0) {
+    close(sd);
+    return -1;
+  }
+  sock_bufs(sd);
+  return sd;
+}
 
+/* release: send a shard's held replies once a commit covers them */
+void release(int sd, held_t *h, int *nh) {
+  commit_wait();
+  batch_send(sd, h, *nh);
+  *nh = 0;
+}
+
+/*
+shard_loop: event loop of one shard, pinned to its own core
+Each wakeup drains the socket; replies to mutating requests in that burst
+are held and released after one commit.
+*/
+void *shard_loop(void *arg) {
+  shard_t *sh = (shard_t *) arg;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(sh->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  message_t *raw = (message_t *) malloc(batch_max * sizeof(message_t));
+  int *lens = (int *) malloc(batch_max * sizeof(int));
+  struct sockaddr_in *from = (struct sockaddr_in *) malloc(batch_max * sizeof(struct sockaddr_in));
+  held_t *out = (held_t *) malloc(batch_max * sizeof(held_t));
+  held_t *h = (held_t *) malloc(GROUP_MAX * sizeof(held_t));
+  int n, nh = 0;
+  while (1) {
+    struct epoll_event ev;
+    if (epoll_wait(sh->ep, &ev, 1, -1) <= 0) continue;
+    while ((n = batch_recv(sh->sd, raw, lens, from, batch_max, 0)) > 0) {
+      int nout = 0;
+      for (int i = 0; i < n; i++) {
+        sh->requests++;
+        int rc = serve_datagram(sh->sd, (char *) &raw[i], lens[i], &from[i], &out[nout]);
+        if (rc < 0) continue;
+        if (rc == 2) {
+          fs_flush();
+          batch_send(sh->sd, h, nh);
+          batch_send(sh->sd, out, nout + 1);
+          end_serv();
+        }
+        if (rc == 1 && jnl_active) {
+          h[nh++] = out[nout];
+          if (nh == GROUP_MAX) release(sh->sd, h, &nh);
+        } else {
+          nout++;
+        }
+      }
+      batch_send(sh->sd, out, nout);
     }
-    else if(buf_pk.msg == MFS_UNLINK){
-      rx_pk.node_num = unlink_file(buf_pk.node_num, buf_pk.name);
-      rx_pk.msg = MFS_FEEDBACK;
-      UDP_Write(sd, &s, (char*)&rx_pk, sizeof(message_t));
+    if (nh > 0) release(sh->sd, h, &nh);
+    fs_tick();
+  }
+  return NULL;
+}
 
+/*
+run_shards: serve the port from nshards SO_REUSEPORT sockets, so the kernel
+spreads clients over the shards; the main thread runs the periodic flush
+*/
+int run_shards(int port) {
+  if (nshards == 0) nshards = sysconf(_SC_NPROCESSORS_ONLN);
+  shards = (shard_t *) calloc(nshards, sizeof(shard_t));
+  for (int i = 0; i < nshards; i++) {
+    shards[i].id = i;
+    shards[i].sd = shard_open(port);
+    shards[i].ep = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &shards[i];
+    if (shards[i].sd < 0 || shards[i].ep < 0 
+      || epoll_ctl(shards[i].ep, EPOLL_CTL_ADD, shards[i].sd, &ev) < 0) {
+      perror("run_shards: cannot open shard socket");
+      return -1;
     }
-    else if(buf_pk.msg == MFS_SHUTDOWN) {
-     /*
-      - Write any remaining data to image
-      - Break from loop
-      */
-      rx_pk.msg = MFS_FEEDBACK;
-      UDP_Write(sd, &s, (char*)&rx_pk, sizeof(message_t));
+  }
+  for (int i = 0; i < nshards; i++) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, shard_loop, &shards[i]) != 0) {
+      perror("run_shards: cannot start shard");
+      return -1;
+    }
+    pthread_detach(t);
+  }
+  while (1) {
+    sleep(flush_secs > 0 ? flush_secs : 1);
+    fs_tick();
+  }
+  return 0;
+}
+
+/*
+tcp_conn: serve one TCP connection (-T) until the client hangs up
+Requests are read frame by frame and answered in order on the connection,
+so a client may send many before reading any reply. As in a pool worker,
+a reply waits for the journal commit covering its operation.
+*/
+void *tcp_conn(void *arg) {
+  int sd = (int) (long) arg;
+  struct sockaddr_in s;
+  socklen_t slen = sizeof(s);
+  getpeername(sd, (struct sockaddr *) &s, &slen);
+  message_t *raw = (message_t *) malloc(sizeof(message_t));
+  held_t *out = (held_t *) malloc(sizeof(held_t));
+  unsigned int pre;
+  while (stream_read(sd, &pre, sizeof(pre)) == 0) {
+    int len = ntohl(pre);
+    if (len < 1 || len > (int) sizeof(message_t) || stream_read(sd, raw, len) < 0)
+      break;
+    __sync_fetch_and_add(&tcp_requests, 1);
+    int rc = serve_datagram(sd, (char *) raw, len, &s, out);
+    if (rc < 0) continue;
+    if (rc == 2) {
+      fs_flush();
+      batch_send(sd, out, 1);
       end_serv();
     }
-    else if(buf_pk.msg == MFS_FEEDBACK) {
-      rx_pk.msg = MFS_FEEDBACK;
-      UDP_Write(sd, &s, (char*)&rx_pk, sizeof(message_t));
+    if (rc == 1 && jnl_active) commit_wait();
+    batch_send(sd, out, 1);
+    fs_tick();
+  }
+  tcp_fd[sd] = 0;
+  close(sd);
+  free(raw);
+  free(out);
+  return NULL;
+}
+
+/* tcp_accept: take TCP connections on listening socket *arg, each served by its own tcp_conn thread */
+void *tcp_accept(void *arg) {
+  int ls = *(int *) arg;
+  while (1) {
+    int sd = accept(ls, NULL, NULL);
+    if (sd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("tcp_accept: accept");
+      sleep(1);
+      continue;
+    }
+    if (sd >= tcp_nfd) {
+      close(sd);
+      continue;
     }
-    else {
-      perror("invalid MFS function");
-      return -1;
+    int one = 1;
+    struct timeval tv = { TCP_SEND_SECS, 0 };
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    sock_bufs(sd);
+    tcp_fd[sd] = 1;
+    pthread_t t;
+    if (pthread_create(&t, NULL, tcp_conn, (void *) (long) sd) != 0) {
+      perror("tcp_accept: cannot start connection thread");
+      tcp_fd[sd] = 0;
+      close(sd);
+      continue;
     }
+    pthread_detach(t);
+    __sync_fetch_and_add(&tcp_conns, 1);
   }
+  return NULL;
+}
 
+/*
+tcp_start: listen for TCP connections on port, next to the UDP socket(s)
+serving it, and accept them on a thread of their own
+*/
+int tcp_start(int port) {
+  static int ls;
+  struct rlimit rl;
+  getrlimit(RLIMIT_NOFILE, &rl);
+  tcp_nfd = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20) ? 1 << 20 : (int) rl.rlim_cur;
+  tcp_fd = (unsigned char *) calloc(tcp_nfd, 1);
+  /* a client hanging up mid-reply only ends its own connection */
+  signal(SIGPIPE, SIG_IGN);
+
+  int one = 1;
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(port);
+  a.sin_addr.s_addr = INADDR_ANY;
+  pthread_t t;
+  if (tcp_fd == NULL || (ls = socket(AF_INET, SOCK_STREAM, 0)) < 0
+    || setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+    || bind(ls, (struct sockaddr *) &a, sizeof(a)) < 0 || listen(ls, 128) < 0
+    || pthread_create(&t, NULL, tcp_accept, &ls) != 0) {
+    perror("tcp_start: cannot listen");
+    return -1;
+  }
+  pthread_detach(t);
   return 0;
 }
 
+void usage() {
+  fprintf(stderr, "usage: server [-c <cache_blocks>] [-f <flush_secs>] [-m | -u] [-B <dir_blocks>] "
+    "[-t <threads> | -s <shards>] [-b <batch>] [-L <lease_ms>] [-T] <portnum> <image>\n");
+  exit(1);
+}
+
 int main(int argc, char *argv[]) {
-	if(argc != 3) {
-		perror("Usage: server <portnum> <image>\n");
-		exit(1);
-	}
+  int ch;
+  while ((ch = getopt(argc, argv, "c:f:muB:t:s:b:L:T")) != -1) {
+    switch (ch) {
+    case 'c':
+      bc_nframes = atoi(optarg);
+      break;
+    case 'f':
+      flush_secs = atoi(optarg);
+      break;
+    case 'm':
+      use_mmap = 1;
+      break;
+    case 'u':
+      use_uring = 1;
+      break;
+    case 'B':
+      btree_threshold = atoi(optarg);
+      if (btree_threshold < 1 || btree_threshold > DIRECT_PTRS) usage();
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      if (nthreads < 1) usage();
+      break;
+    case 's':
+      nshards = atoi(optarg);
+      if (nshards < 0) usage();
+      break;
+    case 'b':
+      batch_max = atoi(optarg);
+      if (batch_max < 1 || batch_max > 1024) usage();
+      break;
+    case 'L':
+      lease_ms = atoi(optarg);
+      if (lease_ms < 0) usage();
+      break;
+    case 'T':
+      use_tcp = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+	if(argc - optind != 2) usage();
 
-	initialize_serv(argv[2]);
-  run_udp(atoi(argv[1]));
+	initialize_serv(argv[optind + 1]);
+  if (use_tcp && tcp_start(atoi(argv[optind])) < 0) return 1;
+  if (nshards >= 0) run_shards(atoi(argv[optind]));
+  else if (nthreads > 1) run_pool(atoi(argv[optind]));
+  else run_udp(atoi(argv[optind]));
 
 	return 0;
 }
@@ -3,6 +3,7 @@
 
 #define UFS_DIRECTORY (0)
 #define UFS_REGULAR_FILE (1)
+#define UFS_DIR_BTREE (2)    // directory kept as a B-tree rooted at direct[0]
 
 #define UFS_BLOCK_SIZE (4096)
 
@@ -19,6 +20,24 @@ typedef struct {
     int  inum;      // inode number of entry (-1 means entry not used)
 } dir_ent_t;
 
+typedef struct {
+    dir_ent_t entries[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+} dir_block_t;
+
+#define BT_MAGIC (0x42547265)
+#define BT_MAX ((UFS_BLOCK_SIZE - 4 * sizeof(int)) / sizeof(dir_ent_t))
+#define BT_DEPTH_MAX (16) // levels a B-tree may grow to
+
+// one node of a B-tree directory, one per block
+typedef struct {
+    int magic;     // BT_MAGIC
+    int leaf;      // 1 for leaves, 0 for interior nodes
+    int nkeys;     // entries in use
+    int next;      // right sibling of a leaf (-1 if none)
+    dir_ent_t ents[BT_MAX]; // sorted by name; in interior nodes inum is the child
+                            // block and name the lowest name under it
+} bt_node_t;
+
 // presumed: block 0 is the super block
 typedef struct __super {
     int inode_bitmap_addr; // block address (in blocks)
@@ -31,7 +50,41 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int journal_addr;      // block address of the metadata journal (in blocks)
+    int journal_len;       // in blocks, 0 if the image has no journal
+    int log_checkpoint;    // block holding the log checkpoint (a track_t),
+                           // 0 if the image is updated in place
 } super_t;
 
+// journal region: block 0 holds a jsuper_t, the rest is a log of
+// transactions, each a jdesc_t, the logged block images and a jcommit_t
+#define JNL_MAGIC  (0x4a4e4c53)
+#define JNL_DESC   (0x4a444553)
+#define JNL_COMMIT (0x4a434d54)
+#define JNL_MAX ((UFS_BLOCK_SIZE - 3 * sizeof(int)) / sizeof(int))
+
+typedef struct {
+    int magic;     // JNL_MAGIC
+    int seq;       // sequence number of the first transaction to replay
+    int start;     // journal block it starts at
+} jsuper_t;
+
+typedef struct {
+    int magic;     // JNL_DESC
+    int seq;
+    int nblocks;
+    int blocks[JNL_MAX]; // home address of each logged block
+} jdesc_t;
+
+typedef struct {
+    int magic;     // JNL_COMMIT
+    int seq;
+    unsigned int sum; // checksum over the logged block images
+} jcommit_t;
+
+// log-structured images keep inodes in the data region: the checkpoint's
+// node_array locates N_Trace pieces of the inode map, which locate inodes
+#define LFS_MAX_INODES (256 * 16)
+
 
 #endif // __ufs_h__